@@ -0,0 +1,353 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Benchmark of the encoding, upload and send paths. Runs with the in-memory
+// backend on any host, and with the real backends on a Raspberry Pi.
+
+#include "frame-encoder.h"
+#include "led-strip.h"
+#include "multi-spi.h"
+#include "rpi-dma.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace spixels;
+
+namespace {
+enum Backend { BACKEND_MEMORY, BACKEND_MEMORY_DMA, BACKEND_DIRECT, BACKEND_DMA };
+
+Backend backend = BACKEND_MEMORY;
+double seconds_per_run = 0.5;
+
+const int kConnectors[16] = {
+    MultiSPI::SPI_P1,  MultiSPI::SPI_P2,  MultiSPI::SPI_P3,  MultiSPI::SPI_P4,
+    MultiSPI::SPI_P5,  MultiSPI::SPI_P6,  MultiSPI::SPI_P7,  MultiSPI::SPI_P8,
+    MultiSPI::SPI_P9,  MultiSPI::SPI_P10, MultiSPI::SPI_P11, MultiSPI::SPI_P12,
+    MultiSPI::SPI_P13, MultiSPI::SPI_P14, MultiSPI::SPI_P15, MultiSPI::SPI_P16,
+};
+
+typedef LEDStrip *(*StripFactory)(MultiSPI *spi, int connector, int count);
+struct StripType {
+    const char *name;
+    StripFactory factory;
+};
+const StripType kStripTypes[] = {
+    { "WS2801",  CreateWS2801Strip },
+    { "WS2803",  CreateWS2803Strip },
+    { "LPD6803", CreateLPD6803Strip },
+    { "LPD8806", CreateLPD8806Strip },
+    { "APA102",  CreateAPA102Strip },
+    { "SK9822",  CreateSK9822Strip },
+    { "P9813",   CreateP9813Strip },
+};
+
+double Now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+MultiSPI *CreateBackend() {
+    switch (backend) {
+    case BACKEND_MEMORY:     return CreateMemoryMultiSPI(false);
+    case BACKEND_MEMORY_DMA: return CreateMemoryMultiSPI(true);
+    case BACKEND_DIRECT:     return CreateDirectMultiSPI();
+    case BACKEND_DMA:        return CreateDMAMultiSPI();
+    }
+    return NULL;
+}
+
+// Simple frame content that changes with every frame.
+void FillFrame(RGBc *frame, int count, int frame_no) {
+    for (int i = 0; i < count; ++i) {
+        const int v = i + frame_no;
+        frame[i] = RGBc(v & 0xff, (v * 3) & 0xff, (v * 7) & 0xff);
+    }
+}
+
+// Repeatedly call "op" (which does "units" of work each time) for about
+// seconds_per_run, return the time per unit in nanoseconds.
+template <class Op>
+double NanosPerUnit(Op &op, double units) {
+    long iterations = 0;
+    const double start = Now();
+    double elapsed;
+    do {
+        op(iterations++);
+        elapsed = Now() - start;
+    } while (elapsed < seconds_per_run);
+    return 1e9 * elapsed / (iterations * units);
+}
+
+struct SetPixelOp {
+    LEDStrip *strip;
+    const RGBc *frame;
+    void operator()(long iteration) {
+        const int offset = iteration % 16;
+        for (int i = 0; i < strip->count(); ++i)
+            strip->SetPixel(i, frame[i + offset]);
+    }
+};
+
+struct SetFrameOp {
+    LEDStrip *strip;
+    const RGBc *frame;
+    void operator()(long iteration) { strip->SetFrame(frame + iteration % 16); }
+};
+
+struct SetLinearOp {
+    LEDStrip *strip;
+    const uint16_t *rgb;
+    void operator()(long iteration) {
+        strip->SetLinearPixels(0, rgb + 3 * (iteration % 16), strip->count());
+    }
+};
+
+void BenchStripEncoding() {
+    const int kCount = 1024;
+    RGBc *frame = new RGBc[kCount + 16];
+    FillFrame(frame, kCount + 16, 0);
+    uint16_t *linear = new uint16_t[3 * (kCount + 16)];
+    for (int i = 0; i < 3 * (kCount + 16); ++i) {
+        linear[i] = (i * 997) >> (i % 8);  // All kinds of magnitudes.
+    }
+    printf("\n== Strip encoding, %d pixels (ns/pixel)\n", kCount);
+    printf("%-8s %10s %10s %10s\n", "strip", "SetPixel", "SetFrame",
+           "SetLinear");
+    for (size_t t = 0; t < sizeof(kStripTypes) / sizeof(kStripTypes[0]); ++t) {
+        MultiSPI *spi = CreateBackend();
+        LEDStrip *strip = kStripTypes[t].factory(spi, kConnectors[0], kCount);
+        SetPixelOp pixel_op = { strip, frame };
+        SetFrameOp frame_op = { strip, frame };
+        SetLinearOp linear_op = { strip, linear };
+        const double pixel_ns = NanosPerUnit(pixel_op, kCount);
+        const double frame_ns = NanosPerUnit(frame_op, kCount);
+        const double linear_ns = NanosPerUnit(linear_op, kCount);
+        printf("%-8s %10.1f %10.1f %10.1f\n", kStripTypes[t].name,
+               pixel_ns, frame_ns, linear_ns);
+        delete strip;
+        delete spi;
+    }
+    delete [] linear;
+    delete [] frame;
+}
+
+struct SetFramesOp {
+    FrameEncoder *encoder;
+    const RGBc *const *frames;
+    void operator()(long) { encoder->SetFrames(frames); }
+};
+
+void BenchParallelEncoding() {
+    const int kStrips = 16;
+    const int kCount = 480;
+    RGBc *frame = new RGBc[kCount];
+    FillFrame(frame, kCount, 0);
+    const RGBc *frames[kStrips];
+    for (int i = 0; i < kStrips; ++i) frames[i] = frame;
+    printf("\n== FrameEncoder, %d APA102 strips x %d pixels (ns/pixel)\n",
+           kStrips, kCount);
+    for (int threads = 1; threads <= 4; ++threads) {
+        MultiSPI *spi = CreateBackend();
+        FrameEncoder *encoder = CreateFrameEncoder(threads);
+        LEDStrip *strips[kStrips];
+        for (int i = 0; i < kStrips; ++i) {
+            strips[i] = CreateAPA102Strip(spi, kConnectors[i], kCount);
+            encoder->AddStrip(strips[i]);
+        }
+        SetFramesOp op = { encoder, frames };
+        printf("%d thread%s %8.1f\n", threads, threads > 1 ? "s" : " ",
+               NanosPerUnit(op, kStrips * kCount));
+        delete encoder;
+        for (int i = 0; i < kStrips; ++i) delete strips[i];
+        delete spi;
+    }
+    delete [] frame;
+}
+
+struct BufferedByteOp {
+    MultiSPI *spi;
+    int channels;
+    size_t bytes;
+    void operator()(long iteration) {
+        for (int c = 0; c < channels; ++c) {
+            for (size_t pos = 0; pos < bytes; ++pos)
+                spi->SetBufferedByte(kConnectors[c], pos, pos + iteration);
+        }
+    }
+};
+
+struct BufferedBytesOp {
+    MultiSPI *spi;
+    int channels;
+    size_t bytes;
+    const uint8_t *data;
+    void operator()(long iteration) {
+        for (int c = 0; c < channels; ++c) {
+            spi->SetBufferedBytes(kConnectors[c], 0, data + iteration % 16,
+                                  bytes);
+        }
+    }
+};
+
+struct BufferedColumnOp {
+    MultiSPI *spi;
+    size_t bytes;
+    const uint8_t *data;
+    void operator()(long iteration) {
+        for (size_t pos = 0; pos < bytes; ++pos)
+            spi->SetBufferedColumn(pos, data + (pos + iteration) % 256);
+    }
+};
+
+void BenchBufferedBytes() {
+    const int kChannels = 16;
+    const size_t kBytes = 4096;
+    uint8_t *data = new uint8_t[kBytes + 256 + 16];
+    for (size_t i = 0; i < kBytes + 256 + 16; ++i) data[i] = i * 37;
+    MultiSPI *spi = CreateBackend();
+    for (int c = 0; c < kChannels; ++c)
+        spi->RegisterDataGPIO(kConnectors[c], kBytes);
+
+    BufferedByteOp byte_op = { spi, kChannels, kBytes };
+    BufferedBytesOp bytes_op = { spi, kChannels, kBytes, data };
+    BufferedColumnOp column_op = { spi, kBytes, data };
+    printf("\n== MultiSPI buffer, %d channels x %zu bytes (ns/byte)\n",
+           kChannels, kBytes);
+    printf("SetBufferedByte   %8.2f\n",
+           NanosPerUnit(byte_op, kChannels * kBytes));
+    printf("SetBufferedBytes  %8.2f\n",
+           NanosPerUnit(bytes_op, kChannels * kBytes));
+    printf("SetBufferedColumn %8.2f\n",
+           NanosPerUnit(column_op, kChannels * kBytes));
+    delete spi;
+    delete [] data;
+}
+
+struct CopyOp {
+    void *dest;
+    const void *src;
+    size_t size;
+    void operator()(long) { memcpy(dest, src, size); }
+};
+
+// What the DMA implementation does to upload the shadow buffer.
+void BenchUncachedCopy() {
+    const size_t kSize = 4 << 20;
+    void *shadow = malloc(kSize);
+    memset(shadow, 0x55, kSize);
+    struct UncachedMemBlock block = UncachedMemBlock_alloc(kSize);
+    CopyOp uncached = { block.mem, shadow, kSize };
+    void *cached = malloc(kSize);
+    CopyOp cached_op = { cached, shadow, kSize };
+    printf("\n== memcpy() of %zu MiB (MiB/s)\n", kSize >> 20);
+    printf("to cached memory   %8.1f\n",
+           1e9 / NanosPerUnit(cached_op, (double)(1 << 20)));
+    printf("to uncached memory %8.1f\n",
+           1e9 / NanosPerUnit(uncached, (double)(1 << 20)));
+    UncachedMemBlock_free(&block);
+    free(cached);
+    free(shadow);
+}
+
+struct FrameOp {
+    MultiSPI *spi;
+    LEDStrip **strips;
+    int channels;
+    RGBc *frame;
+    void operator()(long iteration) {
+        FillFrame(frame, strips[0]->count(), iteration);
+        for (int c = 0; c < channels; ++c)
+            strips[c]->SetFrame(frame);
+        spi->SendBuffers();
+    }
+};
+
+void BenchEndToEnd() {
+    const int kLengths[] = { 50, 144, 300, 600, 1200 };
+    const int kChannels[] = { 1, 4, 8, 16 };
+    printf("\n== End-to-end APA102 frames/s (every frame new content)\n");
+    printf("%8s", "pixels");
+    for (size_t c = 0; c < sizeof(kChannels) / sizeof(kChannels[0]); ++c)
+        printf(" %6d ch", kChannels[c]);
+    printf("\n");
+    for (size_t l = 0; l < sizeof(kLengths) / sizeof(kLengths[0]); ++l) {
+        printf("%8d", kLengths[l]);
+        RGBc *frame = new RGBc[kLengths[l]];
+        for (size_t c = 0; c < sizeof(kChannels) / sizeof(kChannels[0]); ++c) {
+            MultiSPI *spi = CreateBackend();
+            LEDStrip *strips[16];
+            for (int i = 0; i < kChannels[c]; ++i) {
+                strips[i] = CreateAPA102Strip(spi, kConnectors[i], kLengths[l]);
+            }
+            FrameOp op = { spi, strips, kChannels[c], frame };
+            printf(" %9.1f", 1e9 / NanosPerUnit(op, 1));
+            fflush(stdout);
+            for (int i = 0; i < kChannels[c]; ++i) delete strips[i];
+            delete spi;
+        }
+        printf("\n");
+        delete [] frame;
+    }
+}
+
+int usage(const char *progname) {
+    fprintf(stderr, "usage: %s [options]\n"
+            "Options:\n"
+            "\t-b <backend> : One of memory, memory-dma, direct, dma. "
+            "Default: memory.\n"
+            "\t               direct and dma need to run on a Raspberry Pi.\n"
+            "\t-t <seconds> : Time per measurement. Default: %.1f\n",
+            progname, seconds_per_run);
+    return 1;
+}
+}  // anonymous namespace
+
+int main(int argc, char *argv[]) {
+    const char *backend_name = "memory";
+    int opt;
+    while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+        switch (opt) {
+        case 'b': backend_name = optarg; break;
+        case 't': seconds_per_run = atof(optarg); break;
+        default: return usage(argv[0]);
+        }
+    }
+    if (strcmp(backend_name, "memory") == 0)
+        backend = BACKEND_MEMORY;
+    else if (strcmp(backend_name, "memory-dma") == 0)
+        backend = BACKEND_MEMORY_DMA;
+    else if (strcmp(backend_name, "direct") == 0)
+        backend = BACKEND_DIRECT;
+    else if (strcmp(backend_name, "dma") == 0)
+        backend = BACKEND_DMA;
+    else
+        return usage(argv[0]);
+    if (seconds_per_run <= 0) return usage(argv[0]);
+
+    printf("Backend: %s\n", backend_name);
+    BenchStripEncoding();
+    BenchParallelEncoding();
+    BenchBufferedBytes();
+    if (backend == BACKEND_DMA) BenchUncachedCopy();
+    BenchEndToEnd();
+    return 0;
+}
@@ -0,0 +1,226 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Checks the bytes the strips put on the wire, as decoded by the in-memory
+// backend in each of its buffer layouts: the chip encodings against known
+// references, partial sends and clock domains. Runs on any host; returns
+// non-zero if any check fails.
+
+#include "led-strip.h"
+#include "multi-spi.h"
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace spixels;
+
+namespace {
+struct Layout {
+    const char *name;
+    bool emulate_dma;
+    DMAEncoding encoding;
+};
+const Layout kLayouts[] = {
+    { "plain",        false, DMA_ENCODING_STANDARD },
+    { "dma-standard", true,  DMA_ENCODING_STANDARD },
+    { "dma-compact",  true,  DMA_ENCODING_COMPACT },
+};
+
+typedef LEDStrip *(*StripFactory)(MultiSPI *spi, int connector, int count);
+
+// The wire bytes of three pixels, RGBc(255, 0, 0), RGBc(0, 128, 255) and
+// RGBc(40, 20, 1), at full brightness; start- and end-frame included.
+struct ChipReference {
+    const char *name;
+    StripFactory factory;
+    int length;
+    uint8_t bytes[24];
+};
+const ChipReference kChipReferences[] = {
+    { "WS2801", CreateWS2801Strip, 9,
+      { 0xff, 0x00, 0x00,  0x00, 0x2f, 0xff,  0x05, 0x02, 0x00 } },
+    { "WS2803", CreateWS2803Strip, 9,
+      { 0xff, 0x00, 0x00,  0x00, 0x2f, 0xff,  0x05, 0x02, 0x00 } },
+    { "LPD6803", CreateLPD6803Strip, 14,
+      { 0x00, 0x00, 0x00, 0x00,
+        0xfc, 0x00,  0x80, 0xbf,  0x80, 0x00,
+        0x00, 0x00, 0x00, 0x00 } },
+    { "LPD8806", CreateLPD8806Strip, 10,
+      { 0x80, 0xff, 0x80,  0xff, 0x80, 0x97,  0x80, 0x82, 0x81,
+        0x00 } },
+    { "APA102", CreateAPA102Strip, 17,
+      { 0x00, 0x00, 0x00, 0x00,
+        0xff, 0x00, 0x00, 0xff,  0xff, 0xff, 0x2f, 0x00,
+        0xef, 0x00, 0x04, 0x0a,
+        0xff } },
+    { "SK9822", CreateSK9822Strip, 21,
+      { 0x00, 0x00, 0x00, 0x00,
+        0xff, 0x00, 0x00, 0xff,  0xff, 0xff, 0x2f, 0x00,
+        0xff, 0x00, 0x02, 0x05,
+        0x00, 0x00, 0x00, 0x00, 0x00 } },
+    { "P9813", CreateP9813Strip, 20,
+      { 0x00, 0x00, 0x00, 0x00,
+        0xfc, 0x00, 0x00, 0xff,  0xcf, 0xff, 0x2f, 0x00,
+        0xff, 0x00, 0x02, 0x05,
+        0x00, 0x00, 0x00, 0x00 } },
+};
+
+int failures = 0;
+
+void Report(const char *check, const Layout &layout, bool ok) {
+    printf("%-4s %-28s %s\n", ok ? "ok" : "FAIL", check, layout.name);
+    if (!ok) ++failures;
+}
+
+MemoryMultiSPI *CreateBackend(const Layout &layout) {
+    return CreateMemoryMultiSPI(layout.emulate_dma, layout.encoding);
+}
+
+// Some content different for each pixel and frame.
+void FillFrame(RGBc *frame, int count, int frame_no) {
+    for (int i = 0; i < count; ++i) {
+        frame[i] = RGBc(7 * i + frame_no, 255 - 3 * i, 40 * frame_no + i);
+    }
+}
+
+// Send a frame with a plain buffer to get the bytes a strip of "count"
+// pixels of the given type has on the wire.
+void ReferenceBytes(StripFactory factory, const RGBc *frame, int count,
+                    uint8_t *out, size_t *len) {
+    MemoryMultiSPI *spi = CreateMemoryMultiSPI();
+    LEDStrip *strip = factory(spi, MultiSPI::SPI_P1, count);
+    strip->SetFrame(frame);
+    spi->SendBuffers();
+    *len = spi->serial_bytes();
+    memcpy(out, spi->GetSentBytes(MultiSPI::SPI_P1), *len);
+    delete strip;
+    delete spi;
+}
+
+void CheckChipEncodings(const Layout &layout) {
+    const RGBc pixels[3] = {
+        RGBc(255, 0, 0), RGBc(0, 128, 255), RGBc(40, 20, 1)
+    };
+    for (size_t i = 0; i < sizeof(kChipReferences) / sizeof(ChipReference);
+         ++i) {
+        const ChipReference &ref = kChipReferences[i];
+        MemoryMultiSPI *spi = CreateBackend(layout);
+        LEDStrip *strip = ref.factory(spi, MultiSPI::SPI_P1, 3);
+        strip->SetFrame(pixels);
+        spi->SendBuffers();
+        const bool ok = spi->serial_bytes() == (size_t)ref.length
+            && memcmp(spi->GetSentBytes(MultiSPI::SPI_P1), ref.bytes,
+                      ref.length) == 0;
+        char check[64];
+        snprintf(check, sizeof(check), "encoding %s", ref.name);
+        Report(check, layout, ok);
+        delete strip;
+        delete spi;
+    }
+}
+
+// Change pixel 1 of a strip after a full send: the partial send has to end
+// right after it, with the end-frame written over the data of pixel 2 unless
+// the chip latches on a pause. The next full send has the complete frame.
+void CheckPartialSend(const Layout &layout, const char *name,
+                      StripFactory factory, size_t expected_length,
+                      size_t data_end, uint8_t partial_end_byte) {
+    static const int kCount = 40;
+    RGBc frame[kCount];
+    FillFrame(frame, kCount, 1);
+    uint8_t before[256], after[256];
+    size_t len;
+    ReferenceBytes(factory, frame, kCount, before, &len);
+    frame[1] = RGBc(1, 2, 3);
+    ReferenceBytes(factory, frame, kCount, after, &len);
+
+    MemoryMultiSPI *spi = CreateBackend(layout);
+    LEDStrip *strip = factory(spi, MultiSPI::SPI_P1, kCount);
+    spi->SetPartialSends(true);
+    FillFrame(frame, kCount, 1);
+    strip->SetFrame(frame);
+    spi->SendBuffers();
+    bool ok = spi->GetStats().last_bytes_sent == len;
+
+    strip->SetPixel(1, RGBc(1, 2, 3));
+    spi->SendBuffers();
+    const uint8_t *sent = spi->GetSentBytes(MultiSPI::SPI_P1);
+    ok = ok && spi->GetStats().last_bytes_sent == expected_length
+        && memcmp(sent, after, data_end) == 0;
+    for (size_t i = data_end; i < expected_length; ++i) {
+        ok = ok && sent[i] == partial_end_byte;
+    }
+    ok = ok && memcmp(sent + expected_length, before + expected_length,
+                      len - expected_length) == 0;
+
+    spi->SetPartialSends(false);
+    spi->SendBuffers();
+    ok = ok && memcmp(spi->GetSentBytes(MultiSPI::SPI_P1), after, len) == 0;
+
+    char check[64];
+    snprintf(check, sizeof(check), "partial send %s", name);
+    Report(check, layout, ok);
+    delete strip;
+    delete spi;
+}
+
+// A short strip on its own clock only receives its own bytes; the rest of
+// the frame stays zero. The long strip is not affected.
+void CheckClockDomains(const Layout &layout) {
+    static const int kLong = 30, kShort = 3;
+    RGBc frame[kLong];
+    FillFrame(frame, kLong, 2);
+    uint8_t long_bytes[256], short_bytes[256];
+    size_t long_len, short_len;
+    ReferenceBytes(CreateAPA102Strip, frame, kLong, long_bytes, &long_len);
+    ReferenceBytes(CreateAPA102Strip, frame, kShort, short_bytes, &short_len);
+
+    MemoryMultiSPI *spi = CreateBackend(layout);
+    LEDStrip *long_strip = CreateAPA102Strip(spi, MultiSPI::SPI_P1, kLong);
+    bool ok = spi->AddClockDomain(MultiSPI::SPI_P9);
+    LEDStrip *short_strip = CreateAPA102Strip(spi, MultiSPI::SPI_P2, kShort);
+    long_strip->SetFrame(frame);
+    short_strip->SetFrame(frame);
+    spi->SendBuffers();
+    const uint8_t *sent = spi->GetSentBytes(MultiSPI::SPI_P2);
+    ok = ok && spi->serial_bytes() == long_len
+        && memcmp(spi->GetSentBytes(MultiSPI::SPI_P1), long_bytes,
+                  long_len) == 0
+        && memcmp(sent, short_bytes, short_len) == 0;
+    for (size_t i = short_len; i < long_len; ++i) ok = ok && sent[i] == 0;
+
+    Report("clock domains", layout, ok);
+    delete short_strip;
+    delete long_strip;
+    delete spi;
+}
+}  // anonymous namespace
+
+int main() {
+    for (size_t i = 0; i < sizeof(kLayouts) / sizeof(Layout); ++i) {
+        const Layout &layout = kLayouts[i];
+        CheckChipEncodings(layout);
+        // Two pixels and their end-frame; the WS2801 latches on a pause.
+        CheckPartialSend(layout, "APA102", CreateAPA102Strip,
+                         4 + 2 * 4 + 1, 4 + 2 * 4, 0x00);
+        CheckPartialSend(layout, "WS2801", CreateWS2801Strip,
+                         2 * 3, 2 * 3, 0x00);
+        CheckClockDomains(layout);
+    }
+    if (failures) printf("%d check(s) failed\n", failures);
+    return failures ? 1 : 0;
+}
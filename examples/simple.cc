@@ -2,10 +2,9 @@
  * Simple example how to use the spixels library
  */
 
+#include "frame-clock.h"
 #include "led-strip.h"
 
-#include <unistd.h>  // for usleep()
-
 #define FRAME_RATE 60
 
 using namespace spixels;
@@ -25,6 +24,11 @@ int main() {
     LEDStrip *strip2 = CreateAPA102Strip(spi, MultiSPI::SPI_P2, 144);
     // ... register more strips here. They can be of different types
 
+    // Sends frames at a steady rate.
+    //
+    // See include/frame-clock.h
+    FrameClock frame_clock(FRAME_RATE);
+
     for (unsigned int i = 0; /**/; ++i) {
 	const int pos = i % strip1->count();
         strip1->SetPixel(pos, 0x000000);   // clear previous pixel.
@@ -44,8 +48,7 @@ int main() {
         // A Blue pixel on the second strip.
         strip2->SetPixel(pos+1, 0, 0, 255);
     
-        spi->SendBuffers();  // Send all pixels out at once.
-        usleep(1000000 / FRAME_RATE);
+        frame_clock.SendFrame(spi);  // Send all pixels out at once.
     }
 
     delete strip1;
@@ -0,0 +1,103 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// For an example see ../examples (https://github.com/hzeller/spixels/examples)
+#ifndef SPIXELS_CANVAS_H
+#define SPIXELS_CANVAS_H
+
+#include "frame-encoder.h"
+#include "led-strip.h"
+
+namespace spixels {
+// A rectangle of pixels made of LED strips, e.g. panels of serpentine
+// strips on several connectors. The layout is described once; it is
+// compiled into a table telling for each LED which pixel of the framebuffer
+// it shows. Sending a whole framebuffer is then a single pass over it.
+//
+// Example: two panels of 16x16 LEDs side by side, each a serpentine strip
+// on its own connector, the second one upside down:
+//
+//   Canvas *canvas = CreateCanvas(32, 16);
+//   canvas->AddPanel(left, 0, 0, 0, 16, 16,
+//                    Canvas::WIRING_SERPENTINE, Canvas::ROTATE_0);
+//   canvas->AddPanel(right, 0, 16, 0, 16, 16,
+//                    Canvas::WIRING_SERPENTINE, Canvas::ROTATE_180);
+//   for (;;) {
+//       RenderFrame(framebuffer);  // 32 * 16 RGBc, row by row.
+//       canvas->Blit(framebuffer);
+//       spi->SendBuffers();
+//   }
+class Canvas {
+public:
+    // How the LEDs of a panel are wired: row by row in the same direction,
+    // or every other row in the opposite direction.
+    enum Wiring {
+        WIRING_ROWS,
+        WIRING_SERPENTINE,
+    };
+
+    // Rotation of a panel on the canvas, clockwise.
+    enum Rotation {
+        ROTATE_0,
+        ROTATE_90,
+        ROTATE_180,
+        ROTATE_270,
+    };
+
+    // Does not delete the strips or the encoder.
+    virtual ~Canvas() {}
+
+    virtual int width() const = 0;
+    virtual int height() const = 0;
+
+    // Let LED "strip_pos" of the "strip" show pixel (x, y). Strips are
+    // numbered in the order of their first mapping. Returns false if the
+    // position is outside the strip or canvas.
+    virtual bool MapPixel(LEDStrip *strip, int strip_pos, int x, int y) = 0;
+
+    // Map a panel of "panel_width" x "panel_height" LEDs, which are
+    // connected in the given wiring starting at "strip_pos" of the "strip".
+    // The first LED is in the top left corner of the unrotated panel. The
+    // top left corner of the panel as placed on the canvas, after the
+    // rotation, is (x, y). Parts outside the canvas are not mapped.
+    // Returns false if the panel does not fit on the strip.
+    virtual bool AddPanel(LEDStrip *strip, int strip_pos, int x, int y,
+                          int panel_width, int panel_height,
+                          Wiring wiring, Rotation rotation) = 0;
+
+    virtual int strip_count() const = 0;
+    virtual LEDStrip *strip(int i) = 0;
+
+    // Fill frames[i] with the count() colors for the i-th strip from the
+    // "framebuffer", which contains width() * height() pixels, row by row.
+    // LEDs not mapped are black. Does not change the strips, e.g. for
+    // rendering into the frames of a FrameSender.
+    virtual void Gather(const RGBc *framebuffer, RGBc *const *frames) = 0;
+
+    // Set all the strips to the content of the "framebuffer". The strips are
+    // encoded in bulk, with the FrameEncoder if the canvas has one.
+    virtual void Blit(const RGBc *framebuffer) = 0;
+};
+
+// Create a canvas of the given size. If an "encoder" is given, the strips
+// of the canvas are added to it as they are mapped and Blit() encodes with
+// it; so it must not be used for other strips. Does not take ownership of
+// the encoder.
+Canvas *CreateCanvas(int width, int height, FrameEncoder *encoder = NULL);
+}  // namespace spixels
+
+#endif  // SPIXELS_CANVAS_H
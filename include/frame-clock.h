@@ -0,0 +1,123 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// For an example see ../examples (https://github.com/hzeller/spixels/examples)
+#ifndef SPIXELS_FRAME_CLOCK_H
+#define SPIXELS_FRAME_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "multi-spi.h"
+
+namespace spixels {
+// Paces frames at a fixed rate on absolute deadlines, so the rate does not
+// drift with the time it takes to render and send each frame.
+//
+//   FrameClock clock(120);
+//   for (;;) {
+//       RenderFrame(...);
+//       clock.SendFrame(spi);  // Sends with next deadline.
+//   }
+//
+// Several nodes driving parts of the same installation can present their
+// frames at the same time by putting their deadlines on a shared time grid
+// with SetSharedTime(), see also frame-sync.h.
+class FrameClock {
+public:
+    // What to do if a deadline was missed, e.g. because rendering took too
+    // long. Starting to send up to half a period after the deadline still
+    // counts as on time; such a frame is sent right away.
+    enum Policy {
+        // Skip the deadlines that already have passed and wait for the next
+        // one. Frames stay on the fixed time grid.
+        DROP_LATE_FRAMES,
+
+        // Don't wait until caught up with the schedule, so subsequent frames
+        // follow right after each other until back on time. The total number
+        // of frames over time stays correct.
+        CATCH_UP,
+    };
+
+    FrameClock(float frames_per_second, Policy policy = DROP_LATE_FRAMES);
+
+    // Wait until the next deadline. Returns the number of deadlines that
+    // were skipped (only with DROP_LATE_FRAMES), typically 0. Animations can
+    // use that to advance their time accordingly.
+    int WaitForNextFrame();
+
+    // WaitForNextFrame(), then start sending with spi->SendBuffersAsync().
+    int SendFrame(MultiSPI *spi) {
+        const int skipped = WaitForNextFrame();
+        spi->SendBuffersAsync();
+        RecordSkew(spi);
+        return skipped;
+    }
+
+    // Start the schedule anew with the next frame, e.g. after a pause. The
+    // schedule starts with the first frame.
+    void Reset();
+
+    // Put the deadlines on the grid of multiples of the frame period since
+    // the epoch of the shared time, which is CLOCK_REALTIME plus
+    // "offset_nsec". Nodes with clocks disciplined by NTP or PTP, or with
+    // the offset estimated by a SyncBeacon, then all send at the same
+    // moments. May be called with every frame to update the offset. If the
+    // shared time steps back by more than a period, the schedule starts anew.
+    void SetSharedTime(int64_t offset_nsec = 0);
+
+    // Number of the frame of the last deadline. With the shared time counted
+    // since its epoch, so all nodes can show the same content; otherwise
+    // since the start of the schedule.
+    uint64_t frame_number() const { return frame_number_; }
+
+    uint64_t frames() const { return frames_; }        // Deadlines met/late
+    uint64_t missed_deadlines() const { return missed_; }
+    uint64_t dropped_frames() const { return dropped_; }
+
+    // Largest delay seen between a deadline and waking up for it, i.e. the
+    // jitter of the schedule (not including missed deadlines).
+    uint32_t max_wakeup_delay_usec() const { return max_wakeup_delay_usec_; }
+
+    // Presentation skew of the last frame sent with SendFrame(): how late
+    // the transfer started after its deadline, as reported by the MultiSPI
+    // in Stats::last_transfer_start_usec. Between nodes, the skew is this
+    // plus the error of their shared time.
+    int32_t last_skew_usec() const { return last_skew_usec_; }
+    int32_t max_skew_usec() const { return max_skew_usec_; }
+
+private:
+    void RecordSkew(MultiSPI *spi);
+
+    const int64_t period_nsec_;
+    const Policy policy_;
+    bool started_;               // Schedule starts with first frame.
+    bool shared_time_;           // Deadlines are in the shared time.
+    int64_t shared_offset_nsec_; // Shared time - CLOCK_REALTIME.
+    struct timespec next_deadline_;
+    int64_t deadline_monotonic_nsec_;  // Last deadline, for the skew.
+    uint64_t frame_number_;
+    uint64_t frames_;
+    uint64_t missed_;
+    uint64_t dropped_;
+    uint32_t max_wakeup_delay_usec_;
+    int32_t last_skew_usec_;
+    int32_t max_skew_usec_;
+};
+}  // namespace spixels
+
+#endif  // SPIXELS_FRAME_CLOCK_H
@@ -0,0 +1,62 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// For an example see ../examples (https://github.com/hzeller/spixels/examples)
+#ifndef SPIXELS_FRAME_ENCODER_H
+#define SPIXELS_FRAME_ENCODER_H
+
+#include "led-strip.h"
+
+namespace spixels {
+// Encodes the frames for many LED strips in parallel on multiple cores.
+//
+// The work is split by serial byte position: each thread encodes the
+// pixels of all strips that fall into its range of bytes, so no two threads
+// ever write to the same memory of the MultiSPI.
+// All strips have to be on the same MultiSPI; only strips created with the
+// factories in led-strip.h are encoded in parallel, others serially.
+class FrameEncoder {
+public:
+    virtual ~FrameEncoder() {}
+
+    // Add a strip. The frames passed to SetFrames() are in the order the
+    // strips are added.
+    virtual void AddStrip(LEDStrip *strip) = 0;
+
+    // Set all pixels of all strips: frames[i] contains count() colors for
+    // the i-th strip. Same as calling SetFrame() on each strip, but
+    // using all threads. Returns when everything is encoded; the MultiSPI
+    // can then send.
+    virtual void SetFrames(const RGBc *const *frames) = 0;
+
+protected:
+    // Access to the LEDStrip internals for implementations.
+    static void StoreFrame(LEDStrip *strip, const RGBc *frame);
+    static size_t PixelDataEnd(const LEDStrip *strip) {
+        return strip->PixelDataEnd();
+    }
+    static void EncodeSerialBytes(LEDStrip *strip, size_t from, size_t to) {
+        strip->EncodeSerialBytes(from, to);
+    }
+};
+
+// Create a FrameEncoder using "threads" threads, including the one calling
+// SetFrames(). A good value is the number of cores.
+FrameEncoder *CreateFrameEncoder(int threads = 4);
+}  // namespace spixels
+
+#endif  // SPIXELS_FRAME_ENCODER_H
@@ -0,0 +1,74 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// For an example see ../examples (https://github.com/hzeller/spixels/examples)
+#ifndef SPIXELS_FRAME_SENDER_H
+#define SPIXELS_FRAME_SENDER_H
+
+#include <stdint.h>
+
+#include "led-strip.h"
+#include "multi-spi.h"
+
+namespace spixels {
+// Sends frames from a dedicated output thread, so that rendering and its
+// jitter are decoupled from the output timing.
+//
+// The application renders into the frame returned by GetFrame() and hands
+// it over with SubmitFrame(). The output thread always picks up the latest
+// submitted frame; frames submitted faster than they can be sent are dropped.
+// Handing over frames never blocks and is lock-free (triple buffering).
+//
+// Once started, the output thread owns the MultiSPI and the strips: the
+// application must not call them directly anymore.
+class FrameSender {
+public:
+    // Stops the output thread. Does not delete the MultiSPI or the strips.
+    virtual ~FrameSender() {}
+
+    // Add a strip. Must be called before Start().
+    virtual void AddStrip(LEDStrip *strip) = 0;
+
+    // Start the output thread.
+    // "cpu" if >= 0, pin the thread to this CPU core. Good choice is a core
+    //    not used by the rendering, e.g. reserved with isolcpus=.
+    // "realtime_priority" if > 0, run the thread with SCHED_FIFO with this
+    //    priority (1..99). Needs to be root.
+    // Returns false if the thread could not be started. Not being able to
+    // set affinity or priority is only reported on stderr.
+    virtual bool Start(int cpu = -1, int realtime_priority = 0) = 0;
+
+    // Return the pixel array to render the next frame of the i-th added
+    // strip into. It contains count() pixels and still contains what was
+    // rendered into it some frames ago, so the whole frame needs to be
+    // rendered. Valid until the next SubmitFrame().
+    virtual RGBc *GetFrame(int strip_index) = 0;
+
+    // Hand over the rendered frame to the output thread. Returns right away.
+    virtual void SubmitFrame() = 0;
+
+    // Counters. Submitted = sent + dropped (+ the one in flight).
+    virtual uint64_t frames_submitted() const = 0;
+    virtual uint64_t frames_sent() const = 0;
+    virtual uint64_t frames_dropped() const = 0;
+};
+
+// Create a FrameSender sending with the given MultiSPI.
+FrameSender *CreateFrameSender(MultiSPI *spi);
+}  // namespace spixels
+
+#endif  // SPIXELS_FRAME_SENDER_H
@@ -0,0 +1,85 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// For an example see ../examples (https://github.com/hzeller/spixels/examples)
+#ifndef SPIXELS_FRAME_SYNC_H
+#define SPIXELS_FRAME_SYNC_H
+
+#include <stdint.h>
+
+namespace spixels {
+// Lightweight time synchronization of several nodes for
+// FrameClock::SetSharedTime(), if their clocks are not disciplined by NTP
+// or PTP well enough. One node, the master, broadcasts its CLOCK_REALTIME
+// in UDP beacons; the others estimate the offset of their clock to it.
+//
+// Master:
+//   SyncBeacon *beacon = CreateSyncBeaconSender("192.168.1.255", 5577);
+//   clock.SetSharedTime();
+//   for (;;) {
+//       beacon->SendBeacon();
+//       RenderFrame(clock.frame_number());
+//       clock.SendFrame(spi);
+//   }
+// Others:
+//   SyncBeacon *beacon = CreateSyncBeaconReceiver(5577);
+//   for (;;) {
+//       beacon->ReceiveBeacons();
+//       clock.SetSharedTime(beacon->offset_nsec());
+//       RenderFrame(clock.frame_number());
+//       clock.SendFrame(spi);
+//   }
+//
+// The receive time of the beacons is taken by the kernel. The network
+// delay makes the estimate late by about the same amount on all nodes of
+// the same network, so they stay in sync with each other; queueing delays
+// are filtered out by using the beacon that arrived fastest.
+class SyncBeacon {
+public:
+    // Closes the socket.
+    virtual ~SyncBeacon() {}
+
+    // Master: broadcast the current time. Once per frame is plenty.
+    // Returns false on socket errors.
+    virtual bool SendBeacon() = 0;
+
+    // Others: process the beacons received since the last call, without
+    // blocking. Returns true if there were any.
+    virtual bool ReceiveBeacons() = 0;
+
+    // Estimated time of the master minus the local CLOCK_REALTIME. Zero
+    // for the master.
+    virtual int64_t offset_nsec() const = 0;
+
+    // Spread of the recent offset estimates, a measure for the error of the
+    // shared time between nodes.
+    virtual int64_t jitter_nsec() const = 0;
+
+    // Whether there were beacons recently; always true for the master.
+    virtual bool synchronized() const = 0;
+};
+
+// Create the master, broadcasting to "broadcast_address" (or a single
+// address) on "port". Returns NULL on errors, printing them to stderr.
+SyncBeacon *CreateSyncBeaconSender(const char *broadcast_address, int port);
+
+// Create a node receiving the beacons on "port". Returns NULL on errors,
+// printing them to stderr.
+SyncBeacon *CreateSyncBeaconReceiver(int port);
+}  // namespace spixels
+
+#endif  // SPIXELS_FRAME_SYNC_H
@@ -64,13 +64,23 @@ public:
         SetPixel(pos, RGBc(r, g, b));
     }
 
+    // Set "n" pixels starting at position "start" from the "colors" array.
+    // Same as calling SetPixel() for each, but a lot faster as the
+    // pixels are encoded in bulk. Pixels outside the strip are ignored.
+    void SetPixels(int start, const RGBc *colors, int n);
+
+    // Set all pixels of the strip; "colors" has to contain count() values.
+    void SetFrame(const RGBc *colors) { SetPixels(0, colors, count_); }
+
     // Set overall brightness for all pixels. Range of [0 .. 255].
     // This scales the brightness so that it looks linear luminance corrected
     // for the eye.
     // This will be only having a somewhat pleasing result for LED strips with
     // higher PWM resolution (such as APA102).
     //
-    // Brightness change will take effect with next SendBuffers().
+    // Brightness change will take effect with next SendBuffers(). Changing it
+    // is cheap: the pixels are re-encoded only once when the frame is sent,
+    // no matter how often the brightness changed in between.
     void SetBrightness(uint8_t brigthness);
     inline uint8_t brightness() const { return brightness_; }
 
@@ -87,12 +97,67 @@ public:
     // use if you need the direct values.
     virtual void SetLinearValues(int pos,
                                  uint16_t r, uint16_t g, uint16_t b) = 0;
+
+    // Set "n" pixels starting at position "start" from linear values, with
+    // "rgb" containing r, g, b for each pixel (3 * n values). Same as
+    // calling SetLinearValues() for each, but encoded in bulk, vectorized
+    // where possible. Pixels outside the strip are ignored.
+    void SetLinearPixels(int start, const uint16_t *rgb, int n);
+
 protected:
     LEDStrip(int count);
 
+    // Encode pixels [start .. start+n) of values_ with the current
+    // brightness and write them to the SPI buffer. This is called with
+    // valid ranges only. The default implementation calls SetLinearValues()
+    // for each pixel; implementations typically do something faster.
+    virtual void EncodePixels(int start, int n);
+
+    // Encode "n" linear pixels from "rgb" starting at "start" and write
+    // them to the SPI buffer; called with valid ranges only. The default
+    // implementation calls SetLinearValues() for each pixel.
+    virtual void EncodeLinearPixels(int start, const uint16_t *rgb, int n);
+
+    // Called when all pixels need to be re-encoded, e.g. after a brightness
+    // change. The default does that right away; implementations that get
+    // notified before each send can defer it to then.
+    virtual void InvalidateAllPixels() { EncodePixels(0, count_); }
+
+    // For encoding in parallel with the FrameEncoder: the end of the serial
+    // bytes containing pixel data, and encoding only the pixel data that
+    // falls into the serial bytes [from, to), not writing any other bytes.
+    // Implementations that return 0 as end are not encoded in parallel.
+    virtual size_t PixelDataEnd() const { return 0; }
+    virtual void EncodeSerialBytes(size_t /*from*/, size_t /*to*/) {}
+    friend class FrameEncoder;
+
+    // Store "n" colors to values_ starting at "start" and encode them;
+    // called with valid ranges only. The default implementation calls
+    // StoreValues() and EncodePixels(); implementations can do both in one
+    // pass over the colors.
+    virtual void StoreAndEncodePixels(int start, const RGBc *colors, int n);
+
+    // Copy "n" colors to values_ starting at "start", keeping track of
+    // the last pixel that changed.
+    void StoreValues(int start, const RGBc *colors, int n);
+
+    // The first part of StoreValues(): account for values_ being stored
+    // over pixels set with linear values; the caller updates changed_end_
+    // for the stored colors.
+    void StoreOverLinear(int start, int n);
+
     const int count_;
     RGBc *const values_;
     uint8_t brightness_;
+
+    // One past the last pixel that changed since the last send; for
+    // implementations supporting partial sends.
+    int changed_end_;
+
+    // One past the last pixel set with SetLinearValues() or
+    // SetLinearPixels() since values_ were stored there. Their data does not
+    // correspond to values_.
+    int linear_end_;
 };
 
 // Factories for various LED strips.
@@ -104,6 +169,9 @@ LEDStrip *CreateWS2801Strip(MultiSPI *spi, int connector, int count);
 LEDStrip *CreateLPD6803Strip(MultiSPI *spi, int connector, int count);
 LEDStrip *CreateLPD8806Strip(MultiSPI *spi, int connector, int count);
 LEDStrip *CreateAPA102Strip(MultiSPI *spi, int connector, int count);
+LEDStrip *CreateSK9822Strip(MultiSPI *spi, int connector, int count);
+LEDStrip *CreateP9813Strip(MultiSPI *spi, int connector, int count);
+LEDStrip *CreateWS2803Strip(MultiSPI *spi, int connector, int count);
 }
 
 #endif // SPIXELS_LED_STRIP_H
@@ -20,11 +20,13 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <time.h>
 
 namespace spixels {
 // MultiSPI outputs multiple SPI streams in parallel on different GPIOs.
 // The clock is on a single GPIO-pin. This way, we can transmit 25-ish
-// SPI streams in parallel on a Pi with 40 IO pins.
+// SPI streams in parallel on a Pi with 40 IO pins. Some implementations
+// can output more clocks in parallel, see AddClockDomain().
 // Current implementation assumes that all streams have the same amount
 // of data.
 // Also, there is no chip-select at this point (not needed for the LED strips).
@@ -34,6 +36,101 @@ namespace spixels {
 // a fire-and-forget way.
 class MultiSPI {
 public:
+    // Returned by SendListener::PartialSendLength() if everything needs to
+    // be sent.
+    static const size_t kSendAll = ~(size_t)0;
+
+    // Time spent in a phase of sending frames, in microseconds.
+    struct PhaseTime {
+        PhaseTime() : last_usec(0), total_usec(0), count(0) {}
+
+        void Add(uint32_t usec) {
+            last_usec = usec;
+            total_usec += usec;
+            ++count;
+        }
+        double average_usec() const {
+            return count ? (double)total_usec / count : 0;
+        }
+
+        uint32_t last_usec;           // With the most recent frame.
+        uint64_t total_usec;          // Sum over all 'count' frames.
+        uint64_t count;
+    };
+
+    // Counters describing what has been sent so far.
+    struct Stats {
+        Stats() : frames_sent(0), last_bytes_sent(0), bytes_uploaded(0),
+                  last_bytes_uploaded(0), worst_latency_usec(0), dma_errors(0),
+                  last_clock_khz(0), last_transfer_start_usec(0) {}
+
+        uint64_t frames_sent;         // Number of SendBuffers() calls.
+        // Serial bytes of the most recent frame, of the longest clock
+        // domain. The frame took eight times that many clock cycles.
+        size_t last_bytes_sent;
+
+        // Bytes copied to the memory the output hardware reads from.
+        // Implementations only upload what changed, so this is typically a
+        // lot less than the full buffer for mostly static content.
+        uint64_t bytes_uploaded;      // Total since creation.
+        size_t last_bytes_uploaded;   // With the most recent frame.
+
+        // Phases of sending a frame. Phases an implementation doesn't have
+        // stay zero.
+        PhaseTime encode;    // Deferred encoding in SendListeners.
+        PhaseTime upload;    // Copy to the memory the hardware reads from.
+        PhaseTime transfer;  // Sending on the wire.
+        PhaseTime teardown;  // Resetting the hardware after a transfer.
+
+        // From the SendBuffers() or SendBuffersAsync() call until the frame
+        // is completely sent (or swapped in with continuous refresh).
+        PhaseTime latency;
+        uint32_t worst_latency_usec;
+
+        // Number of transfers ended by a DMA error.
+        uint64_t dma_errors;
+
+        // Average SPI clock achieved with the most recent frame.
+        uint32_t last_clock_khz;
+
+        // CLOCK_MONOTONIC time the most recent transfer started on the wire,
+        // after waiting for the previous one and uploading. With continuous
+        // refresh, the time the swap was requested, as the actual swap is
+        // only known later. Zero before the first.
+        uint64_t last_transfer_start_usec;
+    };
+
+    // Gets notified right before the buffers are sent, so that users of the
+    // MultiSPI can defer expensive updates to once per frame.
+    class SendListener {
+    public:
+        SendListener() : next_listener_(NULL) {}
+        virtual ~SendListener() {}
+
+        // Called at the beginning of SendBuffers()/SendBuffersAsync(). Buffer
+        // content set here is sent with that frame.
+        virtual void OnBeforeSend() = 0;
+
+        // With partial sends (see MultiSPI::SetPartialSends()): return the
+        // number of serial bytes, at least "length", after which the data
+        // of this listener can be cut off in this frame.
+        // Called after OnBeforeSend(), possibly multiple times with
+        // increasing length. The default requires everything to be sent.
+        virtual size_t PartialSendLength(size_t /*length*/) { return kSendAll; }
+
+        // Called with the final number of bytes of a partial send, after
+        // PartialSendLength() was called.
+        virtual void OnPartialSend(size_t /*length*/) {}
+
+        // Called when the buffers of the frame have been sent, or copied for
+        // sending in the background, so they can be modified again.
+        virtual void OnAfterSend() {}
+
+    private:
+        friend class MultiSPI;
+        SendListener *next_listener_;
+    };
+
     // Names of the pin-headers on the breakout board.
     enum {
         SPI_CLOCK = 27,
@@ -61,6 +158,9 @@ public:
     // the corresponding SPI Pin SPI_P1..SPI_P16 constant.
     static int SPIPinForConnector(int connector);
 
+    MultiSPI()
+        : partial_sends_(false), send_all_next_(false), listeners_(NULL),
+          column_gpio_count_(0) {}
     virtual ~MultiSPI() {}
 
     // Register a new data stream for the given GPIO. The SPI data is
@@ -69,19 +169,195 @@ public:
     // SPIPinForConnector().
     //
     // Note, each channel might receive more bytes because they share the
-    // same clock with everyone and it depends on what is the longest requested
-    // length.
+    // same clock with everyone in its clock domain and it depends on what is
+    // the longest requested length there.
     // Overlength transmission bytes are all zero.
     virtual bool RegisterDataGPIO(int gpio, size_t serial_byte_size) = 0;
 
+    // Start a new clock domain with its clock on "clock_gpio": the data GPIOs
+    // registered after this get their clock from it instead of the previous
+    // one. This allows to connect multiple adapter boards with their own
+    // clock line, e.g. for more than 16 strips. All clocks are output by the
+    // same GPIO operations, so they run in parallel and in sync.
+    // Each clock only runs for the longest length registered in its domain.
+    // So with strips of very different lengths, grouping them by length on
+    // separate clocks saves the short ones from receiving the padding up to
+    // the longest strip; they latch their data accordingly earlier. The
+    // frames still take as long as the longest strip needs.
+    // Returns false if the implementation doesn't support multiple clocks or
+    // the GPIO is already in use. Must be called before the first send.
+    virtual bool AddClockDomain(int /*clock_gpio*/) { return false; }
+
     // Set data byte for given gpio channel at given position in the
     // stream. "pos" needs to be in range [0 .. serial_bytes_per_stream)
     // Data is sent with next Send().
     virtual void SetBufferedByte(int data_gpio, size_t pos, uint8_t data) = 0;
 
+    // Set "len" consecutive data bytes for the given gpio channel starting
+    // at position "pos". Same as calling SetBufferedByte() for each byte, but
+    // implementations are typically much faster doing it in bulk.
+    virtual void SetBufferedBytes(int data_gpio, size_t pos,
+                                  const uint8_t *data, size_t len) {
+        for (size_t i = 0; i < len; ++i) {
+            SetBufferedByte(data_gpio, pos + i, data[i]);
+        }
+    }
+
+    // Set the data byte at position "pos" for all channels at once. The
+    // "column" contains 16 bytes, column[i] being the byte for the i-th
+    // data gpio in the order they were registered with RegisterDataGPIO().
+    // Bytes for channels that are not registered are ignored. Only the first
+    // 16 registered channels can be set this way.
+    //
+    // This is the fastest way to fill the buffer if you have data for all
+    // channels anyway: bits are transposed into the GPIO layout for all
+    // channels in one go. The default implementation calls
+    // SetBufferedByte() for each of the GPIOs announced with
+    // AddColumnGPIO().
+    virtual void SetBufferedColumn(size_t pos, const uint8_t *column) {
+        for (int i = 0; i < column_gpio_count_; ++i) {
+            SetBufferedByte(column_gpios_[i], pos, column[i]);
+        }
+    }
+
     // Send data for all streams. Wait for completion. After SendBuffers()
     // has been called once, no new GPIOs can be registered.
     virtual void SendBuffers() = 0;
+
+    // Like SendBuffers(), but only start sending and return right away if the
+    // implementation supports that. The buffered data can be modified for the
+    // next frame while the current one is still being transmitted; a
+    // subsequent SendBuffersAsync() waits for the previous transfer to finish
+    // before starting the new one.
+    // Implementations that can't send in the background just call
+    // SendBuffers().
+    virtual void SendBuffersAsync() { SendBuffers(); }
+
+    // Wait until a transfer started with SendBuffersAsync() has finished.
+    // Returns right away if nothing is in flight.
+    virtual void WaitForCompletion() {}
+
+    // Continuously send the buffers in the background without any CPU
+    // involvement, if the implementation supports that; returns false
+    // otherwise.
+    // After each refresh, the clock is held low for the time of "idle_bits"
+    // bits, e.g. for strips such as the WS2801 that latch their data in a
+    // pause.
+    //
+    // While running, SendBuffers() does not send anything itself but swaps
+    // in the new content after the current refresh is done, so there
+    // is no tearing. It returns when the new content is shown.
+    // SendBuffersAsync() returns right away, WaitForCompletion() waits for
+    // the swap.
+    virtual bool StartContinuousRefresh(int /*idle_bits*/) { return false; }
+
+    // Stop the continuous refresh after the current one is finished.
+    virtual void StopContinuousRefresh() {}
+
+    // Frame cache, to play back animations without encoding them again.
+    // CacheFrame() stores the currently buffered content as it would be
+    // sent with the next SendBuffers(). Returns an ID to send it with
+    // SendCachedFrame() later, or -1 if the implementation doesn't support
+    // it. This needs the memory of the buffers for each frame.
+    virtual int CacheFrame() { return -1; }
+
+    // Send a frame stored with CacheFrame(). Like SendBuffersAsync(), this
+    // returns right away if the implementation can send in the background.
+    // The buffered content is not changed by this. Returns false for unknown
+    // IDs or while in continuous refresh.
+    virtual bool SendCachedFrame(int /*id*/) { return false; }
+
+    // Free all the cached frames; their IDs become invalid.
+    virtual void ClearFrameCache() {}
+
+    // Partial sends: only send the serial bytes up to the last data that
+    // changed since the previous frame, as determined by the SendListeners
+    // (e.g. LED strips). So the time to send scales with the changed part
+    // instead of the full length. Unless all listeners support it, the full
+    // length is sent. Not used with the continuous refresh. Default off.
+    //
+    // Only the listeners are asked, writes to the buffers are not tracked:
+    // with partial sends on, everything setting buffered data has to be a
+    // SendListener reporting it, otherwise data written directly with
+    // SetBufferedByte() and friends beyond the reported length is not sent.
+    void SetPartialSends(bool enable) { partial_sends_ = enable; }
+
+    // Return counters about the transfers so far.
+    Stats GetStats() const { return stats_; }
+
+    // Add or remove a listener to be notified before each send. Does not
+    // take ownership; a listener has to be removed before it is deleted.
+    void AddSendListener(SendListener *listener) {
+        listener->next_listener_ = listeners_;
+        listeners_ = listener;
+    }
+    void RemoveSendListener(SendListener *listener) {
+        SendListener **it = &listeners_;
+        while (*it && *it != listener) it = &(*it)->next_listener_;
+        if (*it) *it = listener->next_listener_;
+    }
+
+protected:
+    // For the default SetBufferedColumn(): to be called by implementations
+    // using it for each data GPIO newly registered in RegisterDataGPIO().
+    void AddColumnGPIO(int gpio) {
+        if (column_gpio_count_ < kMaxColumnGPIOs)
+            column_gpios_[column_gpio_count_++] = gpio;
+    }
+
+    // To be called by implementations at the beginning of sending a frame
+    // of "full_length" bytes. Returns the number of bytes to actually send,
+    // which is less with partial sends if "partial_possible".
+    size_t NotifyBeforeSend(size_t full_length, bool partial_possible);
+
+    // To be called by implementations before copying the buffers for other
+    // purposes than sending, so that deferred updates are done.
+    void PrepareBuffers();
+
+    // To be called by implementations that sent something else than the
+    // buffers, so that the next partial send sends everything.
+    void InvalidatePartialSends() { send_all_next_ = true; }
+
+    // To be called by implementations once the buffers have been sent or
+    // copied for sending.
+    void NotifyAfterSend() {
+        for (SendListener *it = listeners_; it; it = it->next_listener_) {
+            it->OnAfterSend();
+        }
+    }
+
+    // Record the latency of a frame whose sending started at "start_usec"
+    // and that is done at "end_usec".
+    void RecordLatency(uint64_t start_usec, uint64_t end_usec) {
+        const uint32_t latency = end_usec - start_usec;
+        stats_.latency.Add(latency);
+        if (latency > stats_.worst_latency_usec)
+            stats_.worst_latency_usec = latency;
+    }
+
+    // Record the clock rate from sending "bits" taking "usec".
+    void RecordClockRate(uint64_t bits, uint64_t usec) {
+        if (usec > 0) stats_.last_clock_khz = bits * 1000 / usec;
+    }
+
+    static uint64_t MonotonicUsec() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    }
+
+    Stats stats_;
+
+private:
+    size_t PartialSendLength(size_t full_length);
+
+    enum { kMaxColumnGPIOs = 16 };
+
+    bool partial_sends_;
+    bool send_all_next_;
+    SendListener *listeners_;
+    int column_gpios_[kMaxColumnGPIOs];
+    int column_gpio_count_;
 };
 
 // Factory to create a MultiSPI implementation that directly writes to
@@ -92,21 +368,85 @@ public:
 //   - Potentially has jitter which is problematic with LED-strips that
 //     use a time-component for triggering (WS2801).
 // Parameter:
-//   "speed_mhz" rough speed in Mhz of the SPI clock. Useful values 1..15
+//   "speed_mhz" speed in Mhz of the SPI clock. Useful values 1..15
 //   Default is 4. Increase if your set-up can do more and you need the
 //   speed. Decrease if you see erratic behavior.
+//   The timing of the GPIO writes is calibrated at startup and adjusted
+//   with each send, so this is the actual average speed up to what the
+//   Pi can do. See Stats::last_clock_khz for the achieved speed.
 MultiSPI *CreateDirectMultiSPI(int speed_mhz = 4,
                                int clock_gpio = MultiSPI::SPI_CLOCK);
 
+// How the DMA MultiSPI encodes the GPIO operations in memory.
+enum DMAEncoding {
+    // Two 16 byte GPIO operations per bit: one setting the data and clock
+    // low, one for the positive clock edge.
+    // Needs 256 bytes of DMA memory per serial byte.
+    DMA_ENCODING_STANDARD,
+
+    // Consecutive operations share memory, needing only 192 bytes of DMA
+    // memory per serial byte (25% less memory and memory bandwidth).
+    // Difference on the wire: data lines that are high go low right after
+    // the positive clock edge before going to the value of the next bit. So
+    // it is only usable for devices that only sample on the clock edge, which
+    // is the case for all the supported LED strips.
+    DMA_ENCODING_COMPACT,
+};
+
 // Factory to create a MultiSPI implementation that uses DMA to output.
 // Advantages:
 //   - Does not use CPU
 //   - Jitter does not exceed several 10 usec. Needed for WS2801.
+//   - SendBuffersAsync() returns while the transfer continues in the
+//     background, so the next frame can be prepared in the meantime.
 // Disadvantage:
 //   - Limited speed (1-2Mhz). Good for WS2801 which can't go faster
 //     anyway, but wasting potential with LPD6803 or APA102 that can go
 //     much faster.
-MultiSPI *CreateDMAMultiSPI(int clock_gpio = MultiSPI::SPI_CLOCK);
+// On the Pi 4, one of its faster DMA4 engines is used.
+// Parameters:
+//   "clock_gpio" the GPIO pin to use as clock.
+//   "encoding" memory layout of the operations, see DMAEncoding. The
+//     compact version is useful for long strips, for which the required
+//     block of contiguous memory might not be available otherwise.
+//   "speed_khz" if 0, the DMA engine writes as fast as it can, so the
+//     actual speed depends on the memory bus contention. If set, every bit
+//     is paced by the PWM peripheral to this SPI clock speed in kHz; it
+//     can't go faster than the unpaced speed of course. In this mode
+//     the clock is only high briefly after the positive edge, data is stable
+//     during the rest of the bit-time.
+//     Pacing needs three to four times the DMA memory and uses the PWM
+//     peripheral, so it can't be used for audio or PWM output at the same
+//     time.
+MultiSPI *CreateDMAMultiSPI(int clock_gpio = MultiSPI::SPI_CLOCK,
+                            DMAEncoding encoding = DMA_ENCODING_STANDARD,
+                            int speed_khz = 0);
+
+// A MultiSPI that does not need any hardware, but decodes the bit-banged
+// buffer into the bytes each GPIO would see on the wire. Useful to test and
+// benchmark encoding off-device, e.g. on a workstation.
+class MemoryMultiSPI : public MultiSPI {
+public:
+    // Number of bytes sent per GPIO, the longest registered length.
+    virtual size_t serial_bytes() const = 0;
+
+    // Return the serial_bytes() bytes the given GPIO received with the
+    // last SendBuffers() or NULL if the GPIO is not registered.
+    // After a partial send, only the first Stats::last_bytes_sent are new,
+    // the rest is what was sent before. Likewise, only bytes up to the
+    // length of the GPIO's clock domain are ever sent.
+    virtual const uint8_t *GetSentBytes(int gpio) const = 0;
+};
+
+// Factory to create a MemoryMultiSPI.
+// Parameter:
+//   "emulate_dma_layout" if false, the buffer is organized as in the
+//     direct implementation: one GPIO word per bit. If true, as the DMA
+//     operations of the given "encoding", and sending emulates the DMA
+//     engine writing them to the GPIO registers.
+MemoryMultiSPI *CreateMemoryMultiSPI(
+    bool emulate_dma_layout = false,
+    DMAEncoding encoding = DMA_ENCODING_STANDARD);
 }
 
 #endif  // SPIXELS_MULTI_SPI_H
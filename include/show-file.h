@@ -0,0 +1,136 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// For an example see ../examples (https://github.com/hzeller/spixels/examples)
+#ifndef SPIXELS_SHOW_FILE_H
+#define SPIXELS_SHOW_FILE_H
+
+#include <stdint.h>
+
+#include "multi-spi.h"
+
+namespace spixels {
+// Show files contain pre-encoded frames: the serial bytes of each channel
+// as they go out on the wire. Playing them back needs no encoding, so
+// long shows can be played with little CPU and with constant memory as
+// the file is streamed from disk.
+//
+// Shows are recorded by rendering into LED strips on a MemoryMultiSPI
+// with the same GPIOs and strip types as the real setup:
+//
+//   MemoryMultiSPI *spi = CreateMemoryMultiSPI();
+//   LEDStrip *strip = CreateAPA102Strip(spi, MultiSPI::SPI_P1, 144);
+//   ShowWriter *writer = CreateShowWriter("show.spx", spi, 60);
+//   writer->AddChannel(MultiSPI::SPI_P1, "APA102", 144);
+//   for (...) {
+//       RenderFrame(strip);
+//       writer->WriteFrame();
+//   }
+//   delete writer;
+//
+// and played on the real one:
+//
+//   MultiSPI *spi = CreateDMAMultiSPI();
+//   ShowPlayer *player = OpenShowFile("show.spx", spi);
+//   player->Play();
+//
+// File format, all numbers in the byte order of the host that recorded it
+// (little endian on the Pi), so files don't move between hosts of
+// different byte order:
+//   char     magic[8]             "SPIXSHOW"
+//   uint32_t version              1
+//   uint32_t channel_count
+//   uint32_t serial_bytes         Bytes per channel and frame.
+//   uint32_t frame_rate_millihz   Frames per 1000 seconds.
+//   uint64_t frame_count          0 if recording did not finish.
+//   uint64_t data_offset          Start of the frames, page aligned.
+// followed by channel_count channel descriptions of
+//   int32_t  gpio
+//   uint32_t led_count            Informational.
+//   char     strip_type[24]       Informational, zero terminated.
+// The frames start at data_offset. Each frame contains serial_bytes bytes
+// for each of the channels, in the order of the channel descriptions.
+
+// Records frames into a show file.
+class ShowWriter {
+public:
+    // Finishes the file.
+    virtual ~ShowWriter() {}
+
+    // Record the given GPIO of the MemoryMultiSPI. The strip type and LED
+    // count only describe what is connected. Must be called before the
+    // first WriteFrame().
+    virtual bool AddChannel(int gpio, const char *strip_type,
+                            int led_count) = 0;
+
+    // Send the buffers of the MemoryMultiSPI and append what each channel
+    // received as new frame. Returns false on write errors.
+    virtual bool WriteFrame() = 0;
+
+    virtual uint64_t frames_written() const = 0;
+};
+
+// Create a show file with the given "frames_per_second" recording
+// from the "spi". Does not take ownership of the spi. Returns NULL if the
+// file can't be created.
+ShowWriter *CreateShowWriter(const char *filename, MemoryMultiSPI *spi,
+                             float frames_per_second);
+
+// Plays a show file. The file is memory mapped in windows, with the kernel
+// reading ahead of the current frame and pages already played dropped
+// from memory, so even shows much larger than the memory can be played.
+class ShowPlayer {
+public:
+    struct Channel {
+        int gpio;
+        int led_count;
+        char strip_type[24];
+    };
+
+    // Closes the file. Does not delete the MultiSPI.
+    virtual ~ShowPlayer() {}
+
+    virtual uint64_t frame_count() const = 0;
+    virtual float frames_per_second() const = 0;
+    virtual int channel_count() const = 0;
+    virtual const Channel &channel(int i) const = 0;
+
+    // Set the buffers of the MultiSPI to the content of the given frame.
+    // Returns false if there is no such frame.
+    //
+    // The frames are stored per channel, not in the bit layout of a
+    // backend, so each one is still written with SetBufferedBytes() for
+    // every channel, spreading its bits into the buffer of the MultiSPI.
+    // That is the remaining work per frame; it grows with channels times
+    // serial bytes.
+    virtual bool LoadFrame(uint64_t frame) = 0;
+
+    // Play "count" frames beginning with "first_frame" at the frame rate
+    // of the show, or until its end. If sending falls behind, frames are
+    // skipped to stay in time. Returns the number of frames sent.
+    virtual uint64_t Play(uint64_t first_frame = 0,
+                          uint64_t count = ~(uint64_t)0) = 0;
+};
+
+// Open a show file to be played on the "spi". The channels of the show are
+// registered with the spi, so nothing must have been sent with it yet and
+// its GPIOs must not have been registered before. Does not take ownership
+// of the spi. Returns NULL on errors, printing them to stderr.
+ShowPlayer *OpenShowFile(const char *filename, MultiSPI *spi);
+}  // namespace spixels
+
+#endif  // SPIXELS_SHOW_FILE_H
@@ -0,0 +1,73 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+//
+// For an example see ../examples (https://github.com/hzeller/spixels/examples)
+#ifndef SPIXELS_UDP_RECEIVER_H
+#define SPIXELS_UDP_RECEIVER_H
+
+#include <stdint.h>
+
+#include "canvas.h"
+#include "frame-sender.h"
+
+namespace spixels {
+// Receives frames over the network into the framebuffer of a Canvas and
+// hands each finished frame to a FrameSender.
+//
+// Two protocols are understood, on the same port:
+//   - PPM over UDP as used by FlaschenTaschen: each packet is a binary
+//     (P6) PPM image, drawn at the offset given in a "#FT: x y z" header
+//     comment or as "x y z" footer after the image data. Each packet
+//     finishes a frame.
+//   - DDP (Distributed Display Protocol): RGB data written at a byte
+//     offset into the framebuffer; the packet with the push flag finishes
+//     the frame.
+//
+// Packets are received in batches with recvmmsg() into a large socket
+// buffer. Of several frames finished in one batch, only the last is handed
+// to the sender, as it would drop the others anyway.
+//
+//   Canvas *canvas = CreateCanvas(...);  // Add the panels.
+//   FrameSender *sender = CreateFrameSender(spi);
+//   for (int i = 0; i < canvas->strip_count(); ++i)
+//       sender->AddStrip(canvas->strip(i));
+//   sender->Start();
+//   UDPReceiver *receiver = CreateUDPReceiver(1337, canvas, sender);
+//   while (receiver->ReceiveFrame()) {}
+class UDPReceiver {
+public:
+    // Closes the socket. Does not delete the canvas or the sender.
+    virtual ~UDPReceiver() {}
+
+    // Receive packets until at least one frame is finished and handed to
+    // the sender. Returns false on socket errors.
+    virtual bool ReceiveFrame() = 0;
+
+    // Counters of packets received, the ones not understood, and frames.
+    virtual uint64_t packets_received() const = 0;
+    virtual uint64_t packets_invalid() const = 0;
+    virtual uint64_t frames_received() const = 0;
+};
+
+// Create a receiver listening on the UDP "port". The strips of the
+// "canvas" have to be added to the "sender" in the order of the canvas.
+// Does not take ownership of the canvas or the sender. Returns NULL if the
+// socket can't be opened, printing the reason to stderr.
+UDPReceiver *CreateUDPReceiver(int port, Canvas *canvas, FrameSender *sender);
+}  // namespace spixels
+
+#endif  // SPIXELS_UDP_RECEIVER_H
@@ -0,0 +1,110 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#ifndef SPIXELS_BIT_TRANSPOSE_H
+#define SPIXELS_BIT_TRANSPOSE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define SPIXELS_HAVE_NEON 1
+#endif
+
+namespace spixels {
+// Transpose a column of 16 bytes, one per channel, into the 8 bit-slices
+// as they go out on the wire: out[0] contains the most significant bits
+// of all channels, out[7] the least significant bits. Bit 'c' of each
+// slice belongs to channel 'c'.
+static inline void Transpose8x16(const uint8_t in[16], uint16_t out[8]) {
+#ifdef SPIXELS_HAVE_NEON
+    static const uint8_t kLaneWeight[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+                                             1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t column = vld1q_u8(in);
+    const uint8x16_t weight = vld1q_u8(kLaneWeight);
+    for (int b = 0; b < 8; ++b) {
+        const uint8x16_t bits = vandq_u8(
+            vtstq_u8(column, vdupq_n_u8(0x80 >> b)), weight);
+        // Horizontally add each half: lane 0 low channels, lane 1 high ones.
+        uint8x8_t sum = vpadd_u8(vget_low_u8(bits), vget_high_u8(bits));
+        sum = vpadd_u8(sum, sum);
+        sum = vpadd_u8(sum, sum);
+        out[b] = vget_lane_u16(vreinterpret_u16_u8(sum), 0);
+    }
+#else
+    // Two 8x8 bit-matrix transposes in a 64 bit word each (Hacker's Delight)
+    uint64_t half[2];
+    memcpy(half, in, sizeof(half));
+    for (int h = 0; h < 2; ++h) {
+        uint64_t x = half[h], t;
+        t = (x ^ (x >> 7))  & 0x00AA00AA00AA00AAULL; x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x = x ^ t ^ (t << 28);
+        half[h] = x;
+    }
+    for (int b = 0; b < 8; ++b) {
+        const int shift = 8 * (7 - b);
+        out[b] = ((half[0] >> shift) & 0xff) | ((half[1] >> shift) & 0xff) << 8;
+    }
+#endif
+}
+
+// Maps the channel bits of a transposed column to the bits of the GPIO
+// register the channels are connected to. Channels are numbered in the
+// order they are added.
+class ChannelMapper {
+public:
+    enum { kMaxChannels = 16 };
+
+    ChannelMapper() : count_(0), gpio_mask_(0) {
+        memset(low_, 0, sizeof(low_));
+        memset(high_, 0, sizeof(high_));
+    }
+
+    // Add channel for given gpio. Returns false if the gpio was already
+    // added or if all channels are used.
+    bool AddChannel(int gpio) {
+        const uint32_t gpio_bit = 1 << gpio;
+        if ((gpio_mask_ & gpio_bit) || count_ >= kMaxChannels) return false;
+        uint32_t *table = (count_ < 8) ? low_ : high_;
+        const int channel_bit = 1 << (count_ % 8);
+        for (int v = 0; v < 256; ++v) {
+            if (v & channel_bit) table[v] |= gpio_bit;
+        }
+        gpio_mask_ |= gpio_bit;
+        ++count_;
+        return true;
+    }
+
+    // GPIO bits to be set for given channel bits.
+    inline uint32_t ToGPIO(uint16_t channel_bits) const {
+        return low_[channel_bits & 0xff] | high_[channel_bits >> 8];
+    }
+
+    // All the GPIO bits covered by the channels.
+    inline uint32_t gpio_mask() const { return gpio_mask_; }
+
+private:
+    int count_;
+    uint32_t gpio_mask_;
+    uint32_t low_[256];   // Lookup for channels 0..7
+    uint32_t high_[256];  // Lookup for channels 8..15
+};
+}  // namespace spixels
+
+#endif  // SPIXELS_BIT_TRANSPOSE_H
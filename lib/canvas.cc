@@ -0,0 +1,154 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "canvas.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <vector>
+
+namespace spixels {
+namespace {
+class CanvasImpl : public Canvas {
+public:
+    CanvasImpl(int width, int height, FrameEncoder *encoder);
+    virtual ~CanvasImpl();
+
+    virtual int width() const { return width_; }
+    virtual int height() const { return height_; }
+    virtual bool MapPixel(LEDStrip *strip, int strip_pos, int x, int y);
+    virtual bool AddPanel(LEDStrip *strip, int strip_pos, int x, int y,
+                          int panel_width, int panel_height,
+                          Wiring wiring, Rotation rotation);
+    virtual int strip_count() const { return strips_.size(); }
+    virtual LEDStrip *strip(int i) { return strips_[i].strip; }
+    virtual void Gather(const RGBc *framebuffer, RGBc *const *frames);
+    virtual void Blit(const RGBc *framebuffer);
+
+private:
+    // Index of the framebuffer pixel for each LED of a strip, or kUnmapped.
+    struct MappedStrip {
+        LEDStrip *strip;
+        uint32_t *pixel_index;
+        RGBc *frame;            // Gathered for Blit().
+    };
+
+    static const uint32_t kUnmapped = ~(uint32_t)0;
+
+    MappedStrip *FindOrAddStrip(LEDStrip *strip);
+
+    const int width_;
+    const int height_;
+    FrameEncoder *const encoder_;
+    std::vector<MappedStrip> strips_;
+    std::vector<RGBc*> frames_;    // Of strips_, as passed to Gather().
+};
+}  // end anonymous namespace
+
+CanvasImpl::CanvasImpl(int width, int height, FrameEncoder *encoder)
+    : width_(width), height_(height), encoder_(encoder) {
+}
+
+CanvasImpl::~CanvasImpl() {
+    for (size_t i = 0; i < strips_.size(); ++i) {
+        free(strips_[i].pixel_index);
+        delete [] strips_[i].frame;
+    }
+}
+
+CanvasImpl::MappedStrip *CanvasImpl::FindOrAddStrip(LEDStrip *strip) {
+    for (size_t i = 0; i < strips_.size(); ++i) {
+        if (strips_[i].strip == strip) return &strips_[i];
+    }
+    MappedStrip mapped;
+    mapped.strip = strip;
+    mapped.pixel_index = (uint32_t*)malloc(strip->count() * sizeof(uint32_t));
+    for (int i = 0; i < strip->count(); ++i) {
+        mapped.pixel_index[i] = kUnmapped;
+    }
+    mapped.frame = new RGBc[strip->count()];
+    strips_.push_back(mapped);
+    frames_.push_back(mapped.frame);
+    if (encoder_) encoder_->AddStrip(strip);
+    return &strips_.back();
+}
+
+bool CanvasImpl::MapPixel(LEDStrip *strip, int strip_pos, int x, int y) {
+    if (strip_pos < 0 || strip_pos >= strip->count()
+        || x < 0 || x >= width_ || y < 0 || y >= height_) {
+        return false;
+    }
+    FindOrAddStrip(strip)->pixel_index[strip_pos] = y * width_ + x;
+    return true;
+}
+
+bool CanvasImpl::AddPanel(LEDStrip *strip, int strip_pos, int x, int y,
+                          int panel_width, int panel_height,
+                          Wiring wiring, Rotation rotation) {
+    if (strip_pos < 0 || panel_width <= 0 || panel_height <= 0
+        || strip_pos + panel_width * panel_height > strip->count()) {
+        return false;
+    }
+    for (int row = 0; row < panel_height; ++row) {
+        for (int i = 0; i < panel_width; ++i) {
+            const int col = (wiring == WIRING_SERPENTINE && row % 2 == 1)
+                ? panel_width - 1 - i
+                : i;
+            int px, py;  // Position on the rotated panel.
+            switch (rotation) {
+            case ROTATE_90:  px = panel_height - 1 - row; py = col; break;
+            case ROTATE_180: px = panel_width - 1 - col;
+                             py = panel_height - 1 - row; break;
+            case ROTATE_270: px = row; py = panel_width - 1 - col; break;
+            default:         px = col; py = row; break;
+            }
+            // Parts outside the canvas are fine.
+            MapPixel(strip, strip_pos + row * panel_width + i, x + px, y + py);
+        }
+    }
+    return true;
+}
+
+void CanvasImpl::Gather(const RGBc *framebuffer, RGBc *const *frames) {
+    const RGBc black;
+    for (size_t s = 0; s < strips_.size(); ++s) {
+        const uint32_t *index = strips_[s].pixel_index;
+        const uint32_t *const end = index + strips_[s].strip->count();
+        for (RGBc *out = frames[s]; index < end; ++index, ++out) {
+            *out = (*index == kUnmapped) ? black : framebuffer[*index];
+        }
+    }
+}
+
+void CanvasImpl::Blit(const RGBc *framebuffer) {
+    if (strips_.empty()) return;
+    Gather(framebuffer, &frames_[0]);
+    if (encoder_) {
+        encoder_->SetFrames(&frames_[0]);
+    } else {
+        for (size_t s = 0; s < strips_.size(); ++s) {
+            strips_[s].strip->SetFrame(strips_[s].frame);
+        }
+    }
+}
+
+// Public interface
+Canvas *CreateCanvas(int width, int height, FrameEncoder *encoder) {
+    return new CanvasImpl(width, height, encoder);
+}
+}  // namespace spixels
@@ -0,0 +1,45 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// Generated by generate-cie1931-table.py. Do not edit.
+
+#ifndef SPIXELS_CIE1931_TABLE_H
+#define SPIXELS_CIE1931_TABLE_H
+
+#include <stdint.h>
+
+// CIE1931 corrected values for luminance values 0..255 at full brightness.
+static const uint16_t kCIE1931FullBrightness[256] = {
+        0,    28,    56,    85,   113,   142,   170,   199,
+      227,   256,   284,   313,   341,   370,   398,   427,
+      455,   484,   512,   541,   569,   597,   627,   657,
+      688,   721,   754,   789,   824,   861,   898,   937,
+      976,  1017,  1059,  1102,  1146,  1192,  1238,  1286,
+     1335,  1385,  1437,  1490,  1544,  1599,  1655,  1713,
+     1773,  1833,  1895,  1958,  2023,  2089,  2157,  2226,
+     2296,  2368,  2442,  2516,  2593,  2671,  2750,  2831,
+     2914,  2998,  3084,  3172,  3261,  3351,  3444,  3538,
+     3634,  3731,  3830,  3931,  4034,  4139,  4245,  4353,
+     4463,  4575,  4688,  4804,  4921,  5041,  5162,  5285,
+     5410,  5537,  5666,  5797,  5930,  6065,  6202,  6341,
+     6482,  6625,  6770,  6918,  7067,  7219,  7373,  7529,
+     7687,  7847,  8010,  8175,  8342,  8511,  8683,  8857,
+     9033,  9211,  9392,  9575,  9761,  9949, 10139, 10332,
+    10527, 10725, 10925, 11128, 11333, 11540, 11750, 11963,
+    12178, 12396, 12616, 12839, 13065, 13293, 13523, 13757,
+    13993, 14232, 14473, 14717, 14964, 15214, 15467, 15722,
+    15980, 16241, 16504, 16771, 17040, 17312, 17587, 17865,
+    18146, 18430, 18717, 19007, 19299, 19595, 19894, 20195,
+    20500, 20808, 21119, 21433, 21750, 22070, 22393, 22720,
+    23049, 23382, 23718, 24057, 24400, 24745, 25094, 25446,
+    25802, 26160, 26522, 26888, 27256, 27628, 28004, 28383,
+    28765, 29150, 29539, 29932, 30328, 30727, 31130, 31536,
+    31946, 32360, 32777, 33197, 33622, 34049, 34481, 34916,
+    35354, 35797, 36243, 36692, 37146, 37603, 38063, 38528,
+    38996, 39468, 39944, 40424, 40908, 41395, 41886, 42381,
+    42880, 43383, 43890, 44401, 44916, 45434, 45957, 46483,
+    47014, 47549, 48087, 48630, 49177, 49728, 50283, 50842,
+    51405, 51973, 52544, 53120, 53700, 54284, 54872, 55465,
+    56062, 56663, 57268, 57878, 58492, 59110, 59733, 60360,
+    60991, 61627, 62267, 62912, 63561, 64214, 64872, 65535,
+};
+
+#endif  // SPIXELS_CIE1931_TABLE_H
@@ -17,6 +17,7 @@
 
 #include "multi-spi.h"
 
+#include "bit-transpose.h"
 #include "ft-gpio.h"
 
 #include <math.h>
@@ -25,34 +26,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <algorithm>
+#include <vector>
 
 namespace spixels {
-
-// This should be in a multi-spi.cc, but that would be the only function. So
-// here is good as well.
-int MultiSPI::SPIPinForConnector(int connector) {
-    switch (connector) {
-    case 1:  return SPI_P1;
-    case 2:  return SPI_P2;
-    case 3:  return SPI_P3;
-    case 4:  return SPI_P4;
-    case 5:  return SPI_P5;
-    case 6:  return SPI_P6;
-    case 7:  return SPI_P7;
-    case 8:  return SPI_P8;
-
-    case 9:  return SPI_P9;
-    case 10: return SPI_P10;
-    case 11: return SPI_P11;
-    case 12: return SPI_P12;
-    case 13: return SPI_P13;
-    case 14: return SPI_P14;
-    case 15: return SPI_P15;
-    case 16: return SPI_P16;
-    }
-    return -1;
-}
-
 namespace {
 class DirectMultiSPI : public MultiSPI {
 public:
@@ -60,46 +36,146 @@ public:
     virtual ~DirectMultiSPI();
 
     virtual bool RegisterDataGPIO(int gpio, size_t serial_byte_size);
+    virtual bool AddClockDomain(int clock_gpio);
     virtual void SetBufferedByte(int data_gpio, size_t pos, uint8_t data);
+    virtual void SetBufferedBytes(int data_gpio, size_t pos,
+                                  const uint8_t *data, size_t len);
+    virtual void SetBufferedColumn(size_t pos, const uint8_t *column);
     virtual void SendBuffers();
 
+    virtual int CacheFrame();
+    virtual bool SendCachedFrame(int id);
+    virtual void ClearFrameCache();
+
 private:
-    const int clock_gpio_;
-    const int write_repeat_;  // how often write operations to repeat to slowdown
+    struct CachedFrame {
+        uint32_t *gpio_data;
+        size_t size;
+    };
+
+    struct ClockDomain {
+        uint32_t clock_bit;
+        size_t serial_bytes;    // Longest data GPIO in this domain.
+    };
+
+    void Calibrate();
+    void AdjustSpeed(uint64_t bits, uint64_t transfer_usec);
+    void Send(const uint32_t *gpio_data, size_t bytes);
+    uint32_t ClockMaskForByte(size_t pos) const;
+
+    uint32_t clock_mask_;       // The clocks of all clock domains.
+    const int speed_mhz_;
+    int write_repeat_;  // how often write operations to repeat to slowdown
+    int too_slow_count_;
     ft::GPIO gpio_;
+    ChannelMapper channels_;
+    uint32_t data_gpio_mask_;   // All registered data GPIOs.
+    std::vector<ClockDomain> domains_;  // Data GPIOs go to the last one.
     size_t size_;
     uint32_t *gpio_data_;
+    std::vector<CachedFrame> frame_cache_;
 };
 }  // end anonymous namespace
 
 DirectMultiSPI::DirectMultiSPI(int speed_mhz, int clock_gpio)
-    : clock_gpio_(clock_gpio),
-      write_repeat_(std::max(2, (int)roundf(30.0 / speed_mhz))),
-      size_(0), gpio_data_(NULL) {
+    : clock_mask_(1 << clock_gpio),
+      speed_mhz_(std::max(1, speed_mhz)), write_repeat_(1), too_slow_count_(0),
+      data_gpio_mask_(0), size_(0), gpio_data_(NULL) {
+    const ClockDomain first = { clock_mask_, 0 };
+    domains_.push_back(first);
     bool success = gpio_.Init();
     assert(success);  // gpio couldn't be initialized
     success = gpio_.AddOutput(clock_gpio);
     assert(success);  // clock pin not valid
+    Calibrate();
+}
+
+// The time a GPIO write takes varies a lot between Pi models and with the CPU
+// frequency. So we measure it and determine the number of write repetitions
+// needed for the requested speed.
+// To start with, time writes that don't change any outputs; with each send
+// we then adjust it with the actually achieved speed.
+void DirectMultiSPI::Calibrate() {
+    const int kWrites = 20000;
+    const uint64_t start = MonotonicUsec();
+    for (int i = 0; i < kWrites; ++i) gpio_.ClearBits(clock_mask_);
+    const double write_usec = double(MonotonicUsec() - start) / kWrites;
+    const double half_bit_usec = 0.5 / speed_mhz_;
+    write_repeat_ = std::max(1, (int)lrint(half_bit_usec / write_usec));
+}
+
+// Called after each send with the achieved timing: recalculate repetitions
+// from the time a write actually took, if off by more than 10%.
+// Transfers that got interrupted by the scheduler look too slow, so only
+// adjust towards slower if it happens repeatedly. Very short (partial) sends
+// are too imprecise to measure.
+void DirectMultiSPI::AdjustSpeed(uint64_t bits, uint64_t transfer_usec) {
+    const uint64_t kMinMeasureUsec = 200;
+    if (bits == 0 || transfer_usec < kMinMeasureUsec) return;
+    const double achieved_mhz = (double)bits / transfer_usec;
+    if (fabs(achieved_mhz - speed_mhz_) < 0.1 * speed_mhz_) {
+        too_slow_count_ = 0;
+        return;
+    }
+    if (achieved_mhz < speed_mhz_ && ++too_slow_count_ < 3)
+        return;
+    too_slow_count_ = 0;
+    const double write_usec = transfer_usec / (2.0 * bits * write_repeat_);
+    const double half_bit_usec = 0.5 / speed_mhz_;
+    write_repeat_ = std::max(1, (int)lrint(half_bit_usec / write_usec));
 }
 
 DirectMultiSPI::~DirectMultiSPI() {
+    ClearFrameCache();
     free(gpio_data_);
 }
 
 bool DirectMultiSPI::RegisterDataGPIO(int gpio, size_t serial_byte_size) {
+    if (gpio < 0 || gpio > 31 || (clock_mask_ & (1 << gpio))
+        || !gpio_.AddOutput(gpio)) {
+        return false;
+    }
     if (serial_byte_size > size_) {
         const int prev_size = size_ * 8 * sizeof(uint32_t);
         const int new_size = serial_byte_size * 8 * sizeof(uint32_t);
         size_ = serial_byte_size;
-	if (gpio_data_ == NULL) {
+        if (gpio_data_ == NULL) {
             gpio_data_ = (uint32_t*)malloc(new_size);
         } else {
             gpio_data_ = (uint32_t*)realloc(gpio_data_, new_size);
         }
-        bzero(gpio_data_ + prev_size, new_size-prev_size);
+        bzero((uint8_t*)gpio_data_ + prev_size, new_size - prev_size);
+    }
+
+    channels_.AddChannel(gpio);
+    data_gpio_mask_ |= (1 << gpio);
+    ClockDomain &domain = domains_.back();
+    domain.serial_bytes = std::max(domain.serial_bytes, serial_byte_size);
+    return true;
+}
+
+// All clocks are written together, so they are just more bits to write.
+// Each only for the length of its domain, see ClockMaskForByte().
+bool DirectMultiSPI::AddClockDomain(int clock_gpio) {
+    if (clock_gpio < 0 || clock_gpio > 31) return false;
+    const uint32_t clock_bit = 1 << clock_gpio;
+    if (((clock_mask_ | data_gpio_mask_) & clock_bit)
+        || !gpio_.AddOutput(clock_gpio)) {
+        return false;
     }
+    clock_mask_ |= clock_bit;
+    const ClockDomain domain = { clock_bit, 0 };
+    domains_.push_back(domain);
+    return true;
+}
 
-    return gpio_.AddOutput(gpio);
+// The clocks of the domains that still have data at serial byte "pos".
+uint32_t DirectMultiSPI::ClockMaskForByte(size_t pos) const {
+    uint32_t result = 0;
+    for (size_t i = 0; i < domains_.size(); ++i) {
+        if (pos < domains_[i].serial_bytes) result |= domains_[i].clock_bit;
+    }
+    return result;
 }
 
 void DirectMultiSPI::SetBufferedByte(int data_gpio, size_t pos, uint8_t data) {
@@ -114,15 +190,102 @@ void DirectMultiSPI::SetBufferedByte(int data_gpio, size_t pos, uint8_t data) {
     }
 }
 
+void DirectMultiSPI::SetBufferedBytes(int data_gpio, size_t pos,
+                                      const uint8_t *data, size_t len) {
+    assert(pos + len <= size_);
+    const uint32_t gpio_bit = 1 << data_gpio;
+    uint32_t *buffer_pos = gpio_data_ + 8 * pos;
+    for (const uint8_t *end = data + len; data < end; ++data) {
+        const uint8_t d = *data;
+        for (int shift = 7; shift >= 0; --shift, buffer_pos++) {
+            const uint32_t value = -(uint32_t)((d >> shift) & 1) & gpio_bit;
+            *buffer_pos = (*buffer_pos & ~gpio_bit) | value;
+        }
+    }
+}
+
+void DirectMultiSPI::SetBufferedColumn(size_t pos, const uint8_t *column) {
+    assert(pos < size_);
+    uint16_t bits[8];
+    Transpose8x16(column, bits);
+    const uint32_t mask = channels_.gpio_mask();
+    uint32_t *buffer_pos = gpio_data_ + 8 * pos;
+    for (int b = 0; b < 8; ++b) {
+        buffer_pos[b] = (buffer_pos[b] & ~mask) | channels_.ToGPIO(bits[b]);
+    }
+}
+
 void DirectMultiSPI::SendBuffers() {
-    uint32_t *end = gpio_data_ + 8 * size_;
-    for (uint32_t *data = gpio_data_; data < end; ++data) {
-        uint32_t d = *data;
-        for (int i = 0; i < write_repeat_; ++i) gpio_.Write(d);
-        d |= (1 << clock_gpio_);   // pos clock edge.
-        for (int i = 0; i < write_repeat_; ++i) gpio_.Write(d);
+    const uint64_t start = MonotonicUsec();
+    const size_t bytes = NotifyBeforeSend(size_, true);
+    Send(gpio_data_, bytes);
+    NotifyAfterSend();
+    RecordLatency(start, MonotonicUsec());
+}
+
+int DirectMultiSPI::CacheFrame() {
+    PrepareBuffers();
+    const size_t data_size = 8 * size_ * sizeof(uint32_t);
+    CachedFrame frame;
+    frame.gpio_data = (uint32_t*)malloc(data_size);
+    if (frame.gpio_data == NULL) return -1;
+    memcpy(frame.gpio_data, gpio_data_, data_size);
+    frame.size = size_;
+    frame_cache_.push_back(frame);
+    return frame_cache_.size() - 1;
+}
+
+bool DirectMultiSPI::SendCachedFrame(int id) {
+    if (id < 0 || id >= (int)frame_cache_.size()) return false;
+    const uint64_t start = MonotonicUsec();
+    const CachedFrame &frame = frame_cache_[id];
+    stats_.last_bytes_sent = frame.size;
+    Send(frame.gpio_data, frame.size);
+    InvalidatePartialSends();
+    RecordLatency(start, MonotonicUsec());
+    return true;
+}
+
+void DirectMultiSPI::ClearFrameCache() {
+    for (size_t i = 0; i < frame_cache_.size(); ++i) {
+        free(frame_cache_[i].gpio_data);
+    }
+    frame_cache_.clear();
+}
+
+// Each bit is sent as two half-bit phases of write_repeat_ register stores.
+// In the first, the clock goes low together with the data bits that change
+// from the previous bit; the pins that stay unchanged are not written, and
+// if no data pin goes high, there is no store to the set register at all.
+// The second phase is a single store raising the clock. Repeats just write
+// the same value again to stretch the phase.
+void DirectMultiSPI::Send(const uint32_t *gpio_data, size_t bytes) {
+    const uint64_t transfer_start = MonotonicUsec();
+    stats_.last_transfer_start_usec = transfer_start;
+    const int fill_repeat = write_repeat_ - 1;
+    uint32_t level = 0;  // Data level currently on the pins.
+    gpio_.ClearBits(data_gpio_mask_);
+    const uint32_t *data = gpio_data;
+    for (size_t pos = 0; pos < bytes; ++pos) {
+        const uint32_t clock_bit = ClockMaskForByte(pos);
+        for (const uint32_t *end = data + 8; data < end; ++data) {
+            const uint32_t d = *data;
+            const uint32_t changed = d ^ level;
+            const uint32_t clr = (changed & level) | clock_bit;
+            const uint32_t set = changed & d;
+            gpio_.ClearBits(clr);
+            if (set) gpio_.SetBits(set);
+            for (int i = 0; i < fill_repeat; ++i) gpio_.ClearBits(clr);
+            for (int i = 0; i < write_repeat_; ++i) gpio_.SetBits(clock_bit);
+            level = d;
+        }
     }
-    gpio_.Write(0);  // Reset clock.
+    gpio_.ClearBits(level | clock_mask_);  // Reset clock and data.
+    const uint64_t transfer_usec = MonotonicUsec() - transfer_start;
+    stats_.transfer.Add(transfer_usec);
+    RecordClockRate(8 * bytes, transfer_usec);
+    stats_.frames_sent++;
+    AdjustSpeed(8 * bytes, transfer_usec);
 }
 
 // Public interface
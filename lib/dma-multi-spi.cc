@@ -17,10 +17,12 @@
 
 #include "multi-spi.h"
 
+#include "bit-transpose.h"
 #include "ft-gpio.h"
 #include "rpi-dma.h"
 
 #include <assert.h>
+#include <math.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +36,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <vector>
 
 // ---- GPIO specific defines
 #define GPIO_REGISTER_BASE 0x200000
@@ -43,37 +47,239 @@
 
 // ---- DMA specific defines
 #define DMA_CHANNEL       5   // That usually is free.
+#define DMA4_CHANNEL      14  // Pi 4; the kernel only uses 12 and 13.
 #define DMA_BASE          0x007000
 
+// ---- PWM, only used as a clock to pace the DMA (4.2.1.3, 9.6)
+#define PWM_BASE          0x20C000
+#define PWM_CTL           0
+#define PWM_DMAC          2
+#define PWM_RNG1          4
+#define PWM_FIF1          6
+#define PHYSICAL_PWM_FIFO (0x7E000000 + PWM_BASE + 4 * PWM_FIF1)
+
+#define PWM_CTL_PWEN1     (1<<0)
+#define PWM_CTL_MODE1     (1<<1)   // Serializer: RNG1 bits per FIFO word.
+#define PWM_CTL_USEF1     (1<<5)
+#define PWM_CTL_CLRF1     (1<<6)
+#define PWM_DMAC_ENAB     (1<<31)
+#define PWM_DMAC_PANIC(x) ((x)<<8)
+#define PWM_DMAC_DREQ(x)  (x)
+
+// ---- Clock manager providing the PWM clock
+#define CLK_BASE          0x101000
+#define CLK_PWMCTL        (0xA0 / 4)
+#define CLK_PWMDIV        (0xA4 / 4)
+#define CLK_PASSWD        (0x5A << 24)
+#define CLK_CTL_BUSY      (1<<7)
+#define CLK_CTL_ENAB      (1<<4)
+#define CLK_CTL_SRC_PLLD  6
+#define PWM_CLOCK_HZ      50000000  // PLLD divided down to this.
+
 namespace spixels {
 namespace {
 class DMAMultiSPI : public MultiSPI {
 public:
-    explicit DMAMultiSPI(int clock_gpio);
+    DMAMultiSPI(int clock_gpio, DMAEncoding encoding, int speed_khz);
     virtual ~DMAMultiSPI();
 
     virtual bool RegisterDataGPIO(int gpio, size_t serial_byte_size);
+    virtual bool AddClockDomain(int clock_gpio);
     virtual void SetBufferedByte(int data_gpio, size_t pos, uint8_t data);
+    virtual void SetBufferedBytes(int data_gpio, size_t pos,
+                                  const uint8_t *data, size_t len);
+    virtual void SetBufferedColumn(size_t pos, const uint8_t *column);
     virtual void SendBuffers();
+    virtual void SendBuffersAsync();
+    virtual void WaitForCompletion();
+    virtual bool StartContinuousRefresh(int idle_bits);
+    virtual void StopContinuousRefresh();
+
+    virtual int CacheFrame();
+    virtual bool SendCachedFrame(int id);
+    virtual void ClearFrameCache();
 
 private:
+    struct GPIOData;
+
+    // What a control block does: write GPIO operations from memory, or
+    // write the pacing word to the PWM FIFO, waiting for its DREQ.
+    enum BlockType { GPIO_WRITE, PACE_WAIT };
+
+    struct ClockDomain {
+        uint32_t clock_bit;
+        size_t serial_bytes;    // Longest data GPIO in this domain.
+    };
+
+    enum {
+        kWordsPerOp = 4,         // Words in a GPIOData.
+        kMaxOpsPerBlock = 4096,  // Limited range of one DMA 2D transfer.
+
+        // Long strips need a lot of DMA memory; it is allocated in segments
+        // of about this size, as large contiguous blocks might not be
+        // available. A segment always holds at least one control block's
+        // operations.
+        kMaxSegmentBytes = 64 << 10,
+        kPoolChunkBytes = 512 << 10,  // Allocated from the GPU at a time.
+    };
+
+    // A contiguous part of the GPIO operations in uncached memory, together
+    // with the control blocks pointing to them. Contains the words
+    // [shadow_from, shadow_to) of the shadow.
+    struct Segment {
+        struct UncachedMemBlock alloced;
+        uint32_t *gpio_dma;
+        size_t shadow_from;
+        size_t shadow_to;
+    };
+
+    // The GPIO operations as seen by the DMA engine, in segments chained by
+    // their control blocks. We have two of these so that one can be filled
+    // while the other is sent. Each cached frame is one as well, so sending
+    // it is just pointing the DMA engine at it.
+    struct TransferBuffer {
+        TransferBuffer() : cut_block(NULL) { control.mem = NULL; }
+
+        std::vector<Segment> segments;
+        std::vector<struct dma_cb*> blocks;  // In the order of the chain.
+        uint32_t start_bus;         // Physical address of the first block.
+        struct dma_cb* end_block;   // Last block of the data.
+
+        // Blocks not part of the data chain, and the data they write.
+        struct UncachedMemBlock control;
+        struct dma_cb* idle_block;  // Clock low in continuous mode.
+        struct dma_cb* reset_block; // Clock and data low after a partial.
+        uint32_t *pace_word;        // Written to the PWM to wait for DREQ.
+
+        // Block ending the chain early for a partial send, and its original
+        // values. NULL if the full chain is used.
+        struct dma_cb* cut_block;
+        uint32_t cut_length;
+        uint32_t cut_next;
+    };
+
+    void ResizeShadow(size_t serial_bytes);
+    void UpdateClockOps();
+    uint32_t ClockMaskForByte(size_t pos) const;
     void FinishRegistration();
+    bool AllocateTransferBuffer(TransferBuffer *buffer);
+    void FreeTransferBuffer(TransferBuffer *buffer);
+    void ShadowRange(int first_op, int end_op,
+                     size_t *from, size_t *to) const;
+    uint32_t OpBusAddress(const TransferBuffer *buffer, int op) const;
+    void StartTransfer(TransferBuffer *buffer);
+    void CutTransfer(TransferBuffer *buffer, size_t bytes);
+    void SwapContinuousBuffer();
+    void SetupIdleBlock(TransferBuffer *buffer, int idle_bits);
+    bool IsExecuting(const TransferBuffer *buffer);
+    void StartPacingClock();
+    int OpsInChunk(int start_op) const;
+    int SegmentEndOp(int first_op) const;
+    void UploadDirtyRanges(int buffer_index, size_t bytes);
+    uint32_t ExpectedTransferUsec() const;
+    void WaitTransferDone();
+    void ResetChannel();
+
+    // The legacy DMA engines and the DMA4 engines of the Pi 4 have different
+    // control blocks of the same size. These fill in either.
+    void SetupBlock(struct dma_cb *cb, BlockType type,
+                    uint32_t src, uint32_t dst, int rows, int row_bytes,
+                    int src_stride, int dst_stride);
+    inline uint32_t *LengthWord(struct dma_cb *cb) const {
+        return dma4_ ? &((struct dma4_cb*)cb)->length : &cb->length;
+    }
+    inline void SetNext(struct dma_cb *cb, uint32_t bus_addr) {
+        *NextWord(cb) = BlockAddress(bus_addr);
+    }
+    inline uint32_t *NextWord(struct dma_cb *cb) const {
+        return dma4_ ? &((struct dma4_cb*)cb)->next : &cb->next;
+    }
+    // How the DMA engine addresses the control block at "bus_addr".
+    inline uint32_t BlockAddress(uint32_t bus_addr) const {
+        return dma4_ ? BUS_TO_PHYS(bus_addr) >> 5 : bus_addr;
+    }
+    // How the DMA engine addresses memory "p" in "block".
+    inline uint32_t MemAddress(const struct UncachedMemBlock *block,
+                               void *p) const {
+        const uint32_t bus_addr = UncachedMemBlock_to_physical(block, p);
+        return dma4_ ? BUS_TO_PHYS(bus_addr) : bus_addr;
+    }
+    inline bool ChannelActive() const {
+        return dma_channel_->cs & (dma4_ ? DMA4_CS_ACTIVE : DMA_CS_ACTIVE);
+    }
+    inline bool ChannelError() const {
+        return dma_channel_->cs & (dma4_ ? DMA4_CS_ERROR : DMA_CS_ERROR);
+    }
+    inline void MarkDirty(size_t pos) { dirty_[pos] = kAllBuffersDirty; }
+
+    // Word in the shadow that contains the bits to be set for given serial
+    // bit.
+    inline uint32_t *SetWordForBit(size_t bit) {
+        return shadow_ + RowStart(encoding_, gpio_operations_, 2 * bit);
+    }
+
+    // Update the masked bits of the operation at "set_word". Returns non-zero
+    // if anything changed.
+    inline uint32_t UpdateBits(uint32_t *set_word,
+                               uint32_t mask, uint32_t value) {
+        const uint32_t changed = (*set_word & mask) ^ value;
+        *set_word = (*set_word & ~mask) | value;
+        if (clr_offset_) {
+            uint32_t *clr_word = set_word + clr_offset_;
+            *clr_word = (*clr_word & ~mask) | (value ^ mask);
+        }
+        return changed;
+    }
+
+    static size_t ImageWords(DMAEncoding encoding, int gpio_operations);
+    static size_t RowStart(DMAEncoding encoding, int gpio_operations, int op);
 
-    struct GPIOData;
     ft::GPIO gpio_;
-    const int clock_gpio_;
+    ChannelMapper channels_;
+    uint32_t clock_mask_;       // The clocks of all clock domains.
+    const DMAEncoding encoding_;
+    const int clr_offset_;      // Offset set->clr word in an op, 0 if none.
+    const int bit_stride_;      // Words between the set words of two bits.
+    const int speed_khz_;       // Paced by PWM if > 0.
+    const bool dma4_;           // Using a DMA4 engine of the Pi 4.
     size_t serial_byte_size_;   // Number of serial bytes to send.
+    int gpio_operations_;
+    uint32_t data_gpio_mask_;   // All registered data GPIOs.
+    std::vector<ClockDomain> domains_;  // Data GPIOs go to the last one.
 
-    struct UncachedMemBlock alloced_;
-    GPIOData *gpio_dma_;
-    struct dma_cb* start_block_;
+    struct UncachedMemPool pool_;
+    TransferBuffer buffers_[2];
+    int next_buffer_;           // Buffer to be filled with next send.
+    std::vector<TransferBuffer*> frame_cache_;
+    bool transfer_running_;
+    bool continuous_;           // Refreshing in StartContinuousRefresh() mode.
+    bool swap_pending_;         // Continuous mode and waiting for swap.
     struct dma_channel_header* dma_channel_;
+    volatile uint32_t *pwm_reg_;
+
+    uint64_t next_send_start_usec_;  // Start of the frame to be sent next.
+    uint64_t send_start_usec_;       // Start of the frame in flight.
+    uint64_t transfer_start_usec_;
+    size_t next_send_bytes_;         // Length of the frame to be sent next.
+    size_t transfer_bytes_;          // Length of the frame in flight.
+    float fastest_byte_usec_;        // Best time per byte seen so far.
 
-    GPIOData *gpio_shadow_;
-    size_t gpio_buffer_size_;  // Buffer-size for GPIO operations needed.
+    // We keep an in-memory buffer that we directly manipulate in
+    // SetBufferedByte() operations and then copy to the DMA managed buffer
+    // when actually sending. Reason is, that the DMA buffer is uncached
+    // memory and very slow to access in particular for the operations
+    // needed in SetBufferedByte().
+    uint32_t *shadow_;
+    size_t shadow_words_;
+
+    // For each serial byte, one bit per TransferBuffer that tells if the
+    // shadow has changed since that buffer was last uploaded.
+    static const uint8_t kAllBuffersDirty = 0x03;
+    uint8_t *dirty_;
 };
 }  // end anonymous namespace
 
+// One DMA operation writes these four words to consecutive GPIO registers.
 struct DMAMultiSPI::GPIOData {
     uint32_t set;
     uint32_t ignored_upper_set_bits; // bits 33..54 of GPIO. Not needed.
@@ -81,10 +287,20 @@ struct DMAMultiSPI::GPIOData {
     uint32_t clr;
 };
 
-DMAMultiSPI::DMAMultiSPI(int clock_gpio)
-    : clock_gpio_(clock_gpio), serial_byte_size_(0),
-      gpio_dma_(NULL), gpio_shadow_(NULL) {
-    alloced_.mem = NULL;
+DMAMultiSPI::DMAMultiSPI(int clock_gpio, DMAEncoding encoding, int speed_khz)
+    : clock_mask_(1 << clock_gpio), encoding_(encoding),
+      clr_offset_(encoding == DMA_ENCODING_COMPACT ? 0 : kWordsPerOp - 1),
+      bit_stride_(encoding == DMA_ENCODING_COMPACT ? -6 : 2 * kWordsPerOp),
+      speed_khz_(speed_khz), dma4_(ft::GetPiModel() == ft::PI_MODEL_4),
+      serial_byte_size_(0), gpio_operations_(0), data_gpio_mask_(0),
+      next_buffer_(0), transfer_running_(false),
+      continuous_(false), swap_pending_(false), pwm_reg_(NULL),
+      next_send_start_usec_(0), send_start_usec_(0), transfer_start_usec_(0),
+      next_send_bytes_(0), transfer_bytes_(0), fastest_byte_usec_(0),
+      shadow_(NULL), shadow_words_(0), dirty_(NULL) {
+    const ClockDomain first = { clock_mask_, 0 };
+    domains_.push_back(first);
+    UncachedMemPool_init(&pool_, kPoolChunkBytes);
     bool success = gpio_.Init();
     assert(success);  // gpio couldn't be initialized
     success = gpio_.AddOutput(clock_gpio);
@@ -92,8 +308,16 @@ DMAMultiSPI::DMAMultiSPI(int clock_gpio)
 }
 
 DMAMultiSPI::~DMAMultiSPI() {
-    UncachedMemBlock_free(&alloced_);
-    free(gpio_shadow_);
+    StopContinuousRefresh();
+    WaitForCompletion();  // DMA engine must not read freed memory.
+    if (pwm_reg_) pwm_reg_[PWM_CTL] = 0;
+    for (int i = 0; i < 2; ++i) {
+        FreeTransferBuffer(&buffers_[i]);
+    }
+    ClearFrameCache();
+    UncachedMemPool_destroy(&pool_);
+    free(shadow_);
+    free(dirty_);
 }
 
 static int bytes_to_gpio_ops(size_t bytes) {
@@ -104,121 +328,790 @@ static int bytes_to_gpio_ops(size_t bytes) {
     return bytes * 8 * 2 + 1;
 }
 
+// DMA_ENCODING_STANDARD: each operation is a full GPIOData, one after the
+// other.
+//
+// DMA_ENCODING_COMPACT: the operations are stored backwards, 3 words
+// apart, and the DMA engine walks through them with a negative source stride.
+// So each 16 byte read overlaps the next lower operation by one word:
+// the 'clr' word of an operation is the 'set' word of the operation
+// before it. With the operations alternating between 'set data bits'
+// and 'set clock', every data operation clears the clock and every clock
+// operation clears the data bits of the preceding data operation right after
+// the rising edge. The word for the 'clr' of the very first operation is at
+// the end.
+/*static*/ size_t DMAMultiSPI::ImageWords(DMAEncoding encoding, int ops) {
+    if (encoding == DMA_ENCODING_COMPACT)
+        return 3 * ops + 1;
+    return kWordsPerOp * ops;
+}
+
+/*static*/ size_t DMAMultiSPI::RowStart(DMAEncoding encoding, int ops, int op) {
+    if (encoding == DMA_ENCODING_COMPACT)
+        return 3 * (ops - 1 - op);
+    return kWordsPerOp * op;
+}
+
 bool DMAMultiSPI::RegisterDataGPIO(int gpio, size_t requested_bytes) {
-    if (gpio_dma_ != NULL) {
+    if (!buffers_[0].segments.empty()) {
         fprintf(stderr, "Can not register DataGPIO after SendBuffers() has been"
                 "called\n");
         assert(0);
     }
+    if (gpio < 0 || gpio > 31 || (clock_mask_ & (1 << gpio))
+        || !gpio_.AddOutput(gpio)) {
+        return false;
+    }
     if (requested_bytes > serial_byte_size_) {
-        const int prev_gpio_end = bytes_to_gpio_ops(serial_byte_size_) - 1;
-        serial_byte_size_ = requested_bytes;
-        const int gpio_operations = bytes_to_gpio_ops(serial_byte_size_);
-        gpio_buffer_size_ = gpio_operations * sizeof(GPIOData);
-        // We keep an in-memory buffer that we directly manipulate in
-        // SetBufferedByte() operations and then copy to the DMA managed buffer
-        // when actually sending. Reason is, that the DMA buffer is uncached
-        // memory and very slow to access in particular for the operations
-        // needed in SetBufferedByte().
-        // RegisterDataGPIO() can be called multiple times with different sizes,
-        // so we need to be prepared to adjust size.
-        gpio_shadow_ = (GPIOData*)realloc(gpio_shadow_, gpio_buffer_size_);
-        bzero(gpio_shadow_ + prev_gpio_end,
-              (gpio_operations - prev_gpio_end)*sizeof(GPIOData));
-        // Prepare every other element to set the CLK pin so that later, we
-        // only have to set the data.
-        // Even: data, clock low; Uneven: clock pos edge
-        for (int i = prev_gpio_end; i < gpio_operations; ++i) {
-            if (i % 2 == 0)
-                gpio_shadow_[i].clr = (1<<clock_gpio_);
-            else
-                gpio_shadow_[i].set = (1<<clock_gpio_);
-        }
-    }
-
-    return gpio_.AddOutput(gpio);
+        ResizeShadow(requested_bytes);
+    }
+
+    channels_.AddChannel(gpio);
+
+    // Unless set otherwise, the data is all zero. If we have an explicit clr
+    // we need to make sure it is part of it.
+    const uint32_t gpio_bit = 1 << gpio;
+    if (clr_offset_ && !(data_gpio_mask_ & gpio_bit)) {
+        for (int op = 0; op < gpio_operations_; op += 2) {
+            uint32_t *set_word
+                = shadow_ + RowStart(encoding_, gpio_operations_, op);
+            if (!(set_word[0] & gpio_bit)) set_word[clr_offset_] |= gpio_bit;
+        }
+    }
+    data_gpio_mask_ |= gpio_bit;
+
+    ClockDomain &domain = domains_.back();
+    domain.serial_bytes = std::max(domain.serial_bytes, requested_bytes);
+    UpdateClockOps();
+    return true;
 }
 
-void DMAMultiSPI::FinishRegistration() {
-    assert(alloced_.mem == NULL);  // Registered twice ?
-    // One DMA operation can only span a limited amount of range.
-    const int kMaxOpsPerBlock = (2<<15) / sizeof(GPIOData);
-    const int gpio_operations = bytes_to_gpio_ops(serial_byte_size_);
-    const int control_blocks
-        = (gpio_operations + kMaxOpsPerBlock - 1) / kMaxOpsPerBlock;
-    const int alloc_size = (control_blocks * sizeof(struct dma_cb)
-                            + gpio_operations * sizeof(GPIOData));
-    alloced_ = UncachedMemBlock_alloc(alloc_size);
-    gpio_dma_ = (struct GPIOData*) ((uint8_t*)alloced_.mem
-                                    + control_blocks * sizeof(struct dma_cb));
+// All clocks are cleared by the same operations as the first one. The new
+// domain doesn't have any data yet, so its clock is not set anywhere.
+bool DMAMultiSPI::AddClockDomain(int clock_gpio) {
+    if (clock_gpio < 0 || clock_gpio > 31) return false;
+    const uint32_t clock_bit = 1 << clock_gpio;
+    if (!buffers_[0].segments.empty()
+        || ((clock_mask_ | data_gpio_mask_) & clock_bit)
+        || !gpio_.AddOutput(clock_gpio)) {
+        return false;
+    }
+    clock_mask_ |= clock_bit;
+    const ClockDomain domain = { clock_bit, 0 };
+    domains_.push_back(domain);
+    if (clr_offset_) {
+        for (int op = 0; op < gpio_operations_; op += 2) {
+            uint32_t *set_word
+                = shadow_ + RowStart(encoding_, gpio_operations_, op);
+            set_word[clr_offset_] |= clock_bit;
+        }
+    }
+    if (encoding_ == DMA_ENCODING_COMPACT && shadow_)
+        shadow_[shadow_words_ - 1] |= clock_bit;
+    return true;
+}
 
-    struct dma_cb* previous = NULL;
-    struct dma_cb* cb = NULL;
-    struct GPIOData *start_gpio = gpio_dma_;
-    int remaining = gpio_operations;
-    for (int i = 0; i < control_blocks; ++i) {
-        cb = (struct dma_cb*) ((uint8_t*)alloced_.mem + i * sizeof(dma_cb));
-        if (previous) {
-            previous->next = UncachedMemBlock_to_physical(&alloced_, cb);
-        }
-        const int n = remaining > kMaxOpsPerBlock ? kMaxOpsPerBlock : remaining;
-        cb->info   = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
-                      DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_TDMODE);
-        cb->src    = UncachedMemBlock_to_physical(&alloced_, start_gpio);
-        cb->dst    = PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET;
-        cb->length = DMA_CB_TXFR_LEN_YLENGTH(n)
-            | DMA_CB_TXFR_LEN_XLENGTH(sizeof(GPIOData));
-        cb->stride = DMA_CB_STRIDE_D_STRIDE(-16) | DMA_CB_STRIDE_S_STRIDE(0);
-        previous = cb;
-        start_gpio += n;
-        remaining -= n;
+// The clocks of the domains that still have data at serial byte "pos".
+uint32_t DMAMultiSPI::ClockMaskForByte(size_t pos) const {
+    uint32_t result = 0;
+    for (size_t i = 0; i < domains_.size(); ++i) {
+        if (pos < domains_[i].serial_bytes) result |= domains_[i].clock_bit;
     }
-    cb->next = 0;
+    return result;
+}
+
+// Let each clock only do the positive edges for the length of its domain.
+// Clearing a clock that is low anyway does no harm, so the operations
+// clearing them stay as they are.
+void DMAMultiSPI::UpdateClockOps() {
+    for (size_t pos = 0; pos < serial_byte_size_; ++pos) {
+        const uint32_t clocks = ClockMaskForByte(pos);
+        for (size_t bit = 8 * pos; bit < 8 * pos + 8; ++bit) {
+            shadow_[RowStart(encoding_, gpio_operations_, 2 * bit + 1)]
+                = clocks;
+        }
+    }
+}
+
+// RegisterDataGPIO() can be called multiple times with different sizes,
+// so we need to be prepared to adjust size, keeping the data that might
+// already have been set.
+void DMAMultiSPI::ResizeShadow(size_t serial_bytes) {
+    const int ops = bytes_to_gpio_ops(serial_bytes);
+    const size_t words = ImageWords(encoding_, ops);
+    const uint32_t clock_bit = clock_mask_;
+    uint32_t *image = (uint32_t*)calloc(words, sizeof(uint32_t));
 
-    // First block in our chain.
-    start_block_ = (struct dma_cb*) alloced_.mem;
+    // Prepare every other element to set the CLK pin so that later, we
+    // only have to set the data.
+    // Even: data, clock low; Uneven: clock pos edge
+    for (int i = 0; i < ops; ++i) {
+        uint32_t *set_word = image + RowStart(encoding_, ops, i);
+        if (i % 2 == 1)
+            set_word[0] = clock_bit;
+        else if (clr_offset_)
+            set_word[clr_offset_] = clock_bit | data_gpio_mask_;
+    }
+    if (encoding_ == DMA_ENCODING_COMPACT)
+        image[words - 1] = clock_bit;  // Clear of the first data operation.
+
+    // Carry over data already set.
+    for (size_t bit = 0; bit < 8 * serial_byte_size_; ++bit) {
+        const uint32_t *from = SetWordForBit(bit);
+        uint32_t *to = image + RowStart(encoding_, ops, 2 * bit);
+        to[0] = from[0];
+        if (clr_offset_) to[clr_offset_] = from[clr_offset_];
+    }
+
+    free(shadow_);
+    shadow_ = image;
+    shadow_words_ = words;
+    serial_byte_size_ = serial_bytes;
+    gpio_operations_ = ops;
+    dirty_ = (uint8_t*)realloc(dirty_, serial_byte_size_);
+}
+
+void DMAMultiSPI::FinishRegistration() {
+    for (int i = 0; i < 2; ++i) {
+        if (!AllocateTransferBuffer(&buffers_[i])) {
+            fprintf(stderr, "Can not allocate %u bytes of DMA memory\n",
+                    (unsigned) (shadow_words_ * sizeof(uint32_t)));
+            assert(0);
+        }
+    }
+    memset(dirty_, 0, serial_byte_size_);  // All uploaded.
+    if (speed_khz_ > 0) StartPacingClock();
 
     // 4.2.1.2
     char *dmaBase = (char*) ft::mmap_bcm_register(DMA_BASE);
-    dma_channel_ = (struct dma_channel_header*)(dmaBase + 0x100 * DMA_CHANNEL);
+    dma_channel_ = (struct dma_channel_header*)
+        (dmaBase + 0x100 * (dma4_ ? DMA4_CHANNEL : DMA_CHANNEL));
+}
+
+// The legacy engines take bus addresses, the DMA4 engines physical ones
+// with the peripherals at 0x4_7Exx_xxxx. Wider reads help the DMA4 engine,
+// but need the 16 byte alignment of the rows in the standard encoding.
+// Both write the peripherals a word at a time.
+void DMAMultiSPI::SetupBlock(struct dma_cb *cb, BlockType type,
+                             uint32_t src, uint32_t dst,
+                             int rows, int row_bytes,
+                             int src_stride, int dst_stride) {
+    const uint32_t length = DMA_CB_TXFR_LEN_YLENGTH(rows)
+        | DMA_CB_TXFR_LEN_XLENGTH(row_bytes);
+    if (dma4_) {
+        struct dma4_cb *const cb4 = (struct dma4_cb*)cb;
+        const uint32_t peripheral
+            = DMA4_CB_INFO_ADDR_HIGH(DMA4_PERIPHERAL_ADDR_HIGH);
+        if (type == GPIO_WRITE) {
+            cb4->info = DMA4_CB_TI_TDMODE;
+            cb4->src_info = DMA4_CB_INFO_INC | DMA4_CB_INFO_STRIDE(src_stride)
+                | (encoding_ == DMA_ENCODING_STANDARD
+                   ? DMA4_CB_INFO_SIZE_128 : 0);
+            cb4->dst_info = peripheral | DMA4_CB_INFO_INC
+                | DMA4_CB_INFO_STRIDE(dst_stride);
+        } else {
+            cb4->info = (DMA4_CB_TI_PERMAP(DMA_PERMAP_PWM) |
+                         DMA4_CB_TI_DEST_DREQ | DMA4_CB_TI_WAIT_RESP |
+                         DMA4_CB_TI_TDMODE);
+            cb4->src_info = 0;
+            cb4->dst_info = peripheral;
+        }
+        cb4->src = src;
+        cb4->dst = dst;
+        cb4->length = length;
+        cb4->next = 0;
+        return;
+    }
+    if (type == GPIO_WRITE) {
+        cb->info = (DMA_CB_TI_SRC_INC | DMA_CB_TI_DEST_INC |
+                    DMA_CB_TI_NO_WIDE_BURSTS | DMA_CB_TI_TDMODE);
+    } else {
+        cb->info = (DMA_CB_TI_PERMAP(DMA_PERMAP_PWM) |
+                    DMA_CB_TI_DEST_DREQ | DMA_CB_TI_NO_WIDE_BURSTS |
+                    DMA_CB_TI_WAIT_RESP | DMA_CB_TI_TDMODE);
+    }
+    cb->src = src;
+    cb->dst = dst;
+    cb->length = length;
+    cb->stride = DMA_CB_STRIDE_D_STRIDE(dst_stride)
+        | DMA_CB_STRIDE_S_STRIDE(src_stride);
+    cb->next = 0;
+}
+
+// Number of operations we put in the control block starting at "start_op".
+int DMAMultiSPI::OpsInChunk(int start_op) const {
+    const int remaining = gpio_operations_ - start_op;
+    if (speed_khz_ > 0) {
+        // Paced: each chunk is followed by waiting for the pacing clock.
+        // The first chunk sets the first data bit. All the following do the
+        // positive clock edge followed by the next data bit (or final
+        // clock low), so that data is stable while we wait.
+        return start_op == 0 ? 1 : std::min(2, remaining);
+    }
+    return std::min((int)kMaxOpsPerBlock, remaining);
+}
+
+// The chunks of operations starting with "first_op" that fit into one
+// segment; returns the op following them.
+int DMAMultiSPI::SegmentEndOp(int first_op) const {
+    const int blocks_per_chunk = (speed_khz_ > 0) ? 2 : 1;
+    int end_op = first_op + OpsInChunk(first_op);
+    int blocks = blocks_per_chunk;
+    while (end_op < gpio_operations_) {
+        const int next_end = end_op + OpsInChunk(end_op);
+        size_t from, to;
+        ShadowRange(first_op, next_end, &from, &to);
+        const size_t bytes = (blocks + blocks_per_chunk) * sizeof(dma_cb)
+            + (to - from) * sizeof(uint32_t);
+        if (bytes > kMaxSegmentBytes) break;
+        end_op = next_end;
+        blocks += blocks_per_chunk;
+    }
+    return end_op;
+}
+
+// The words of the shadow the operations [first_op, end_op) read.
+void DMAMultiSPI::ShadowRange(int first_op, int end_op,
+                              size_t *from, size_t *to) const {
+    // Depending on the encoding, the operations go up or down in memory.
+    const size_t first = RowStart(encoding_, gpio_operations_, first_op);
+    const size_t last = RowStart(encoding_, gpio_operations_, end_op - 1);
+    *from = std::min(first, last);
+    *to = std::max(first, last) + kWordsPerOp;
+}
+
+// Physical address of the operation in one of the segments containing it.
+uint32_t DMAMultiSPI::OpBusAddress(const TransferBuffer *buffer, int op) const {
+    const size_t row = RowStart(encoding_, gpio_operations_, op);
+    for (size_t i = 0; i < buffer->segments.size(); ++i) {
+        const Segment &segment = buffer->segments[i];
+        if (row >= segment.shadow_from
+            && row + kWordsPerOp <= segment.shadow_to) {
+            return UncachedMemBlock_to_physical(
+                &segment.alloced,
+                segment.gpio_dma + (row - segment.shadow_from));
+        }
+    }
+    assert(0);  // All operations are in a segment.
+    return 0;
+}
+
+// Returns false if there is not enough DMA memory.
+bool DMAMultiSPI::AllocateTransferBuffer(TransferBuffer *buffer) {
+    assert(buffer->segments.empty());  // Registered twice ?
+    const bool paced = (speed_khz_ > 0);
+
+    // Idle and reset block, the reset operation and the pacing word.
+    buffer->control = UncachedMemPool_alloc(&pool_, 2 * sizeof(dma_cb)
+                                            + sizeof(GPIOData)
+                                            + sizeof(uint32_t));
+    if (buffer->control.mem == NULL) return false;
+    struct dma_cb *const control_blocks = (struct dma_cb*)buffer->control.mem;
+    buffer->idle_block = &control_blocks[0];
+    buffer->reset_block = &control_blocks[1];
+
+    // Setting clock and data low at the end of a partial send.
+    GPIOData *const reset_op = (GPIOData*)(control_blocks + 2);
+    reset_op->clr = clock_mask_ | data_gpio_mask_;
+
+    // Dummy data written to the PWM FIFO, just to wait for its DREQ.
+    buffer->pace_word = (uint32_t*)(reset_op + 1);
+    const uint32_t pace_addr = MemAddress(&buffer->control, buffer->pace_word);
+
+    struct dma_cb *cb = buffer->reset_block;
+    SetupBlock(cb, GPIO_WRITE, MemAddress(&buffer->control, reset_op),
+               PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET, 1, sizeof(GPIOData),
+               0, 0);
+
+    // In the compact encoding, we go backwards in memory; the source stride
+    // is applied after the source address was incremented by the 16 bytes
+    // just read.
+    const int src_stride = (encoding_ == DMA_ENCODING_COMPACT)
+        ? -(int)(sizeof(GPIOData) + 3 * sizeof(uint32_t))
+        : 0;
+
+    struct dma_cb* previous = NULL;
+    for (int op = 0; op < gpio_operations_; /**/) {
+        const int end_op = SegmentEndOp(op);
+        int blocks = 0;
+        for (int i = op; i < end_op; i += OpsInChunk(i)) {
+            blocks += paced ? 2 : 1;
+        }
+        Segment segment;
+        ShadowRange(op, end_op, &segment.shadow_from, &segment.shadow_to);
+        const size_t words = segment.shadow_to - segment.shadow_from;
+        segment.alloced = UncachedMemPool_alloc(&pool_,
+                                                blocks * sizeof(dma_cb)
+                                                + words * sizeof(uint32_t));
+        if (segment.alloced.mem == NULL) {
+            FreeTransferBuffer(buffer);
+            return false;
+        }
+        segment.gpio_dma = (uint32_t*) ((uint8_t*)segment.alloced.mem
+                                        + blocks * sizeof(dma_cb));
+        // Contains all the constant parts.
+        memcpy(segment.gpio_dma, shadow_ + segment.shadow_from,
+               words * sizeof(uint32_t));
+        buffer->segments.push_back(segment);
+
+        const struct UncachedMemBlock *const alloced = &segment.alloced;
+        cb = (struct dma_cb*) alloced->mem;
+        while (op < end_op) {
+            const int n = OpsInChunk(op);
+            const uint32_t cb_bus = UncachedMemBlock_to_physical(alloced, cb);
+            if (previous) {
+                SetNext(previous, cb_bus);
+            } else {
+                buffer->start_bus = cb_bus;
+            }
+            uint32_t *start_gpio = segment.gpio_dma
+                + (RowStart(encoding_, gpio_operations_, op)
+                   - segment.shadow_from);
+            SetupBlock(cb, GPIO_WRITE, MemAddress(alloced, start_gpio),
+                       PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET,
+                       n, sizeof(GPIOData), src_stride, -16);
+            buffer->blocks.push_back(cb);
+            previous = cb++;
+            op += n;
+
+            if (paced) {
+                // Blocks until the PWM requests the next word.
+                SetNext(previous, UncachedMemBlock_to_physical(alloced, cb));
+                SetupBlock(cb, PACE_WAIT, pace_addr, PHYSICAL_PWM_FIFO,
+                           1, sizeof(uint32_t), 0, 0);
+                buffer->blocks.push_back(cb);
+                previous = cb++;
+            }
+        }
+    }
+    buffer->end_block = previous;
+    return true;
+}
+
+void DMAMultiSPI::FreeTransferBuffer(TransferBuffer *buffer) {
+    for (size_t i = 0; i < buffer->segments.size(); ++i) {
+        UncachedMemPool_free(&pool_, &buffer->segments[i].alloced);
+    }
+    buffer->segments.clear();
+    buffer->blocks.clear();
+    buffer->cut_block = NULL;
+    UncachedMemPool_free(&pool_, &buffer->control);
+}
+
+// The idle block is what connects the end of a refresh with the start of the
+// next in continuous mode. It keeps repeating the final 'clock low' operation
+// or, if paced, just waits for the pacing clock.
+void DMAMultiSPI::SetupIdleBlock(TransferBuffer *buffer, int idle_bits) {
+    struct dma_cb *const cb = buffer->idle_block;
+    struct UncachedMemBlock *const alloced = &buffer->control;
+    const int kMaxRows = 1 << 14;
+    if (speed_khz_ > 0) {
+        const int rows = std::min(kMaxRows, std::max(1, idle_bits));
+        SetupBlock(cb, PACE_WAIT, MemAddress(alloced, buffer->pace_word),
+                   PHYSICAL_PWM_FIFO, rows, sizeof(uint32_t), 0, 0);
+    } else {
+        // Unpaced, we need two operations for the time of one bit.
+        const int rows = std::min(kMaxRows, std::max(1, 2 * idle_bits));
+        const uint32_t last_op = OpBusAddress(buffer, gpio_operations_ - 1);
+        SetupBlock(cb, GPIO_WRITE, dma4_ ? BUS_TO_PHYS(last_op) : last_op,
+                   PHYSICAL_GPIO_BUS + GPIO_SET_OFFSET,
+                   rows, sizeof(GPIOData), -16, -16);  // Same op again.
+    }
+    SetNext(cb, buffer->start_bus);
+    SetNext(buffer->end_block, UncachedMemBlock_to_physical(alloced, cb));
+}
+
+// We run the PWM in serializer mode, so it consumes one word of the FIFO
+// every RNG1 clock cycles and requests more via DREQ. Each bit of our output
+// waits for that.
+void DMAMultiSPI::StartPacingClock() {
+    pwm_reg_ = ft::mmap_bcm_register(PWM_BASE);
+    volatile uint32_t *clk_reg = ft::mmap_bcm_register(CLK_BASE);
+    assert(pwm_reg_ && clk_reg);  // Needs /dev/mem
+
+    const int plld_hz = (ft::GetPiModel() == ft::PI_MODEL_4)
+        ? 750000000 : 500000000;
+    const int range = std::max(2, (int)lrint(PWM_CLOCK_HZ
+                                             / (1000.0 * speed_khz_)));
+
+    pwm_reg_[PWM_CTL] = 0;
+    usleep(10);
+    clk_reg[CLK_PWMCTL] = CLK_PASSWD | CLK_CTL_SRC_PLLD;  // Disable
+    while (clk_reg[CLK_PWMCTL] & CLK_CTL_BUSY) {
+        usleep(1);
+    }
+    clk_reg[CLK_PWMDIV] = CLK_PASSWD | ((plld_hz / PWM_CLOCK_HZ) << 12);
+    clk_reg[CLK_PWMCTL] = CLK_PASSWD | CLK_CTL_SRC_PLLD | CLK_CTL_ENAB;
+    usleep(10);
+
+    pwm_reg_[PWM_RNG1] = range;
+    pwm_reg_[PWM_DMAC] = PWM_DMAC_ENAB | PWM_DMAC_PANIC(1) | PWM_DMAC_DREQ(1);
+    pwm_reg_[PWM_CTL] = PWM_CTL_CLRF1;
+    usleep(10);
+    pwm_reg_[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
 }
 
 void DMAMultiSPI::SetBufferedByte(int data_gpio, size_t pos, uint8_t data) {
-    assert(pos < serial_byte_size_);
-    GPIOData *buffer_pos = gpio_shadow_ + 2 * 8 * pos;
-    for (uint8_t bit = 0x80; bit; bit >>= 1, buffer_pos += 2) {
-        if (data & bit) {   // set
-            buffer_pos->set |= (1 << data_gpio);
-            buffer_pos->clr &= ~(1 << data_gpio);
-        } else {            // reset
-            buffer_pos->set &= ~(1 << data_gpio);
-            buffer_pos->clr |= (1 << data_gpio);
+    SetBufferedBytes(data_gpio, pos, &data, 1);
+}
+
+void DMAMultiSPI::SetBufferedBytes(int data_gpio, size_t pos,
+                                   const uint8_t *data, size_t len) {
+    assert(pos + len <= serial_byte_size_);
+    const uint32_t gpio_bit = 1 << data_gpio;
+    uint32_t *set_word = SetWordForBit(8 * pos);
+    for (const uint8_t *end = data + len; data < end; ++data, ++pos) {
+        const uint8_t d = *data;
+        uint32_t changed = 0;
+        for (int shift = 7; shift >= 0; --shift, set_word += bit_stride_) {
+            const uint32_t value = -(uint32_t)((d >> shift) & 1) & gpio_bit;
+            changed |= UpdateBits(set_word, gpio_bit, value);
         }
+        if (changed) MarkDirty(pos);
     }
 }
 
+void DMAMultiSPI::SetBufferedColumn(size_t pos, const uint8_t *column) {
+    assert(pos < serial_byte_size_);
+    uint16_t bits[8];
+    Transpose8x16(column, bits);
+    const uint32_t mask = channels_.gpio_mask();
+    uint32_t *set_word = SetWordForBit(8 * pos);
+    uint32_t changed = 0;
+    for (int b = 0; b < 8; ++b, set_word += bit_stride_) {
+        changed |= UpdateBits(set_word, mask, channels_.ToGPIO(bits[b]));
+    }
+    if (changed) MarkDirty(pos);
+}
+
 void DMAMultiSPI::SendBuffers() {
-    if (!gpio_dma_) FinishRegistration();
-    memcpy(gpio_dma_, gpio_shadow_, gpio_buffer_size_);
-
-    dma_channel_->cs |= DMA_CS_END;
-    dma_channel_->cblock = UncachedMemBlock_to_physical(&alloced_, start_block_);
-    dma_channel_->cs = DMA_CS_PRIORITY(7) | DMA_CS_PANIC_PRIORITY(7) | DMA_CS_DISDEBUG;
-    dma_channel_->cs |= DMA_CS_ACTIVE;
-    while ((dma_channel_->cs & DMA_CS_ACTIVE)
-           && !(dma_channel_->cs & DMA_CS_ERROR)) {
+    SendBuffersAsync();
+    WaitForCompletion();
+}
+
+void DMAMultiSPI::SendBuffersAsync() {
+    next_send_start_usec_ = MonotonicUsec();
+    const size_t bytes = NotifyBeforeSend(serial_byte_size_, !continuous_);
+    if (buffers_[0].segments.empty()) FinishRegistration();
+    if (continuous_) {
+        SwapContinuousBuffer();
+        return;
+    }
+
+    // The previous transfer is still running from the other buffer, so we can
+    // already fill this one.
+    UploadDirtyRanges(next_buffer_, bytes);
+    NotifyAfterSend();
+    CutTransfer(&buffers_[next_buffer_], bytes);
+
+    WaitForCompletion();
+    next_send_bytes_ = bytes;
+    StartTransfer(&buffers_[next_buffer_]);
+    next_buffer_ = (next_buffer_ + 1) % 2;
+    stats_.frames_sent++;
+}
+
+// Copying to uncached memory is slow, so only copy the spans of serial bytes
+// that changed since this buffer was last sent, up to the "bytes" to be sent.
+void DMAMultiSPI::UploadDirtyRanges(int buffer_index, size_t bytes) {
+    const uint8_t buffer_bit = 1 << buffer_index;
+    const std::vector<Segment> &segments = buffers_[buffer_index].segments;
+    const int kOpsPerByte = 2 * 8;
+    const uint64_t upload_start = MonotonicUsec();
+    size_t uploaded = 0;
+    size_t pos = 0;
+    while (pos < bytes) {
+        if ((dirty_[pos] & buffer_bit) == 0) {
+            ++pos;
+            continue;
+        }
+        const size_t start = pos;
+        while (pos < bytes && (dirty_[pos] & buffer_bit)) {
+            dirty_[pos++] &= ~buffer_bit;
+        }
+        size_t from, to;
+        ShadowRange(start * kOpsPerByte, pos * kOpsPerByte, &from, &to);
+        for (size_t i = 0; i < segments.size(); ++i) {
+            const Segment &segment = segments[i];
+            const size_t copy_from = std::max(from, segment.shadow_from);
+            const size_t copy_to = std::min(to, segment.shadow_to);
+            if (copy_from >= copy_to) continue;
+            memcpy(segment.gpio_dma + (copy_from - segment.shadow_from),
+                   shadow_ + copy_from,
+                   (copy_to - copy_from) * sizeof(uint32_t));
+            uploaded += (copy_to - copy_from) * sizeof(uint32_t);
+        }
+    }
+    stats_.last_bytes_uploaded = uploaded;
+    stats_.bytes_uploaded += uploaded;
+    stats_.upload.Add(MonotonicUsec() - upload_start);
+}
+
+void DMAMultiSPI::StartTransfer(TransferBuffer *buffer) {
+    if (dma4_) {
+        dma_channel_->cs |= DMA4_CS_END;
+        dma_channel_->cblock = BlockAddress(buffer->start_bus);
+        dma_channel_->cs = DMA4_CS_QOS(7) | DMA4_CS_PANIC_QOS(7)
+            | DMA4_CS_DISDEBUG | DMA4_CS_WAIT_FOR_WRITES;
+        dma_channel_->cs |= DMA4_CS_ACTIVE;
+    } else {
+        dma_channel_->cs |= DMA_CS_END;
+        dma_channel_->cblock = buffer->start_bus;
+        dma_channel_->cs = DMA_CS_PRIORITY(7) | DMA_CS_PANIC_PRIORITY(7)
+            | DMA_CS_DISDEBUG;
+        dma_channel_->cs |= DMA_CS_ACTIVE;
+    }
+    transfer_running_ = true;
+    send_start_usec_ = next_send_start_usec_;
+    transfer_bytes_ = next_send_bytes_;
+    transfer_start_usec_ = MonotonicUsec();
+    stats_.last_transfer_start_usec = transfer_start_usec_;
+}
+
+// Let the chain of control blocks end after the operations of the first
+// "bytes" serial bytes, with the reset block setting clock and data low. (The
+// operation following in the chain can't be used for that: in the compact
+// encoding, data operations only set bits.) Undoes the cut of a previous
+// partial send first.
+void DMAMultiSPI::CutTransfer(TransferBuffer *buffer, size_t bytes) {
+    if (buffer->cut_block) {
+        *LengthWord(buffer->cut_block) = buffer->cut_length;
+        *NextWord(buffer->cut_block) = buffer->cut_next;
+        buffer->cut_block = NULL;
+    }
+    if (bytes >= serial_byte_size_) return;
+    // The last positive clock edge; with zero bytes just the first data
+    // operation, which doesn't do any edge.
+    const int last_op = bytes ? 2 * 8 * bytes - 1 : 0;
+    struct dma_cb *cb;
+    int ops;
+    if (speed_khz_ > 0) {
+        // Chunks of clock edge and next data bit, except the first; each
+        // followed by the block waiting for the pacing clock.
+        cb = buffer->blocks[2 * ((last_op + 1) / 2)];
+        ops = 1;
+    } else {
+        cb = buffer->blocks[last_op / kMaxOpsPerBlock];
+        ops = last_op % kMaxOpsPerBlock + 1;
+    }
+    buffer->cut_block = cb;
+    buffer->cut_length = *LengthWord(cb);
+    buffer->cut_next = *NextWord(cb);
+    *LengthWord(cb) = DMA_CB_TXFR_LEN_YLENGTH(ops)
+        | DMA_CB_TXFR_LEN_XLENGTH(sizeof(GPIOData));
+    SetNext(cb, UncachedMemBlock_to_physical(&buffer->control,
+                                             buffer->reset_block));
+}
+
+bool DMAMultiSPI::StartContinuousRefresh(int idle_bits) {
+    next_send_start_usec_ = MonotonicUsec();
+    if (buffers_[0].segments.empty()) FinishRegistration();
+    if (continuous_) StopContinuousRefresh();
+    WaitForCompletion();
+
+    for (int i = 0; i < 2; ++i) {
+        CutTransfer(&buffers_[i], serial_byte_size_);
+        SetupIdleBlock(&buffers_[i], idle_bits);
+    }
+    // Same as sending a frame, so that deferred updates are done.
+    NotifyBeforeSend(serial_byte_size_, false);
+    UploadDirtyRanges(next_buffer_, serial_byte_size_);
+    NotifyAfterSend();
+    next_send_bytes_ = serial_byte_size_;
+    StartTransfer(&buffers_[next_buffer_]);
+    next_buffer_ = (next_buffer_ + 1) % 2;
+    stats_.frames_sent++;
+    continuous_ = true;
+    return true;
+}
+
+void DMAMultiSPI::StopContinuousRefresh() {
+    if (!continuous_) return;
+    WaitForCompletion();  // Pending swap.
+    // Let the currently running buffer finish.
+    TransferBuffer *const active = &buffers_[(next_buffer_ + 1) % 2];
+    SetNext(active->idle_block, 0);
+    while (ChannelActive() && !ChannelError()) {
         usleep(10);
     }
+    for (int i = 0; i < 2; ++i) {
+        SetNext(buffers_[i].end_block, 0);
+    }
+    continuous_ = false;
+    // The chain ended cleanly, so the channel is ready for the next transfer.
+    // transfer_running_ is still set, so the next wait checks it for errors
+    // as after any transfer ...
+    send_start_usec_ = 0;  // ... but there is no frame to account for.
+}
+
+// The cached frame contains the full shadow, which is uploaded as part of
+// allocating its buffer. Returns -1 if there is not enough DMA memory left.
+int DMAMultiSPI::CacheFrame() {
+    if (buffers_[0].segments.empty()) FinishRegistration();
+    PrepareBuffers();
+    TransferBuffer *frame = new TransferBuffer();
+    if (!AllocateTransferBuffer(frame)) {
+        delete frame;
+        return -1;
+    }
+    frame_cache_.push_back(frame);
+    return frame_cache_.size() - 1;
+}
 
-    dma_channel_->cs |= DMA_CS_ABORT;
-    usleep(100);
-    dma_channel_->cs &= ~DMA_CS_ACTIVE;
-    dma_channel_->cs |= DMA_CS_RESET;
+bool DMAMultiSPI::SendCachedFrame(int id) {
+    if (id < 0 || id >= (int)frame_cache_.size() || continuous_)
+        return false;
+    next_send_start_usec_ = MonotonicUsec();
+    WaitForCompletion();
+    next_send_bytes_ = serial_byte_size_;
+    StartTransfer(frame_cache_[id]);
+    stats_.last_bytes_sent = serial_byte_size_;
+    stats_.frames_sent++;
+    InvalidatePartialSends();
+    return true;
+}
+
+void DMAMultiSPI::ClearFrameCache() {
+    if (frame_cache_.empty()) return;
+    WaitForCompletion();  // Might be sending one of them.
+    for (size_t i = 0; i < frame_cache_.size(); ++i) {
+        FreeTransferBuffer(frame_cache_[i]);
+        delete frame_cache_[i];
+    }
+    frame_cache_.clear();
+}
+
+// In continuous mode, each buffer's idle block loops back to the start of its
+// own chain. To switch, we fill the other buffer and point the currently
+// running idle block at it; the DMA engine will pick that up with the next
+// control block it loads.
+void DMAMultiSPI::SwapContinuousBuffer() {
+    WaitForCompletion();  // Previous swap must be done to reuse its buffer.
+    TransferBuffer *const next = &buffers_[next_buffer_];
+    TransferBuffer *const active = &buffers_[(next_buffer_ + 1) % 2];
+    UploadDirtyRanges(next_buffer_, serial_byte_size_);
+    NotifyAfterSend();
+    SetNext(next->idle_block, next->start_bus);
+    SetNext(active->idle_block, next->start_bus);
+    next_buffer_ = (next_buffer_ + 1) % 2;
+    swap_pending_ = true;
+    send_start_usec_ = next_send_start_usec_;
+    stats_.last_transfer_start_usec = MonotonicUsec();
+    stats_.frames_sent++;
+}
+
+static bool ContainsPhysAddress(const struct UncachedMemBlock &block,
+                                uint32_t phys_addr) {
+    const uint32_t start = BUS_TO_PHYS(block.bus_addr);
+    return phys_addr >= start && phys_addr < start + block.size;
+}
+
+// Check if the control block currently executed is within this buffer.
+bool DMAMultiSPI::IsExecuting(const TransferBuffer *buffer) {
+    const uint32_t current = dma4_
+        ? dma_channel_->cblock << 5
+        : BUS_TO_PHYS(dma_channel_->cblock);
+    if (ContainsPhysAddress(buffer->control, current))
+        return true;
+    for (size_t i = 0; i < buffer->segments.size(); ++i) {
+        if (ContainsPhysAddress(buffer->segments[i].alloced, current))
+            return true;
+    }
+    return false;
+}
+
+// Expected duration of the transfer in flight. Returns 0 if not known yet.
+// The fastest seen so far is the best estimate: the measured time gets longer
+// if we only check late for completion.
+uint32_t DMAMultiSPI::ExpectedTransferUsec() const {
+    if (fastest_byte_usec_ > 0)
+        return fastest_byte_usec_ * transfer_bytes_;
+    if (speed_khz_ > 0)
+        return 8 * transfer_bytes_ * 1000 / speed_khz_;
+    return 0;
+}
+
+// Wait until the DMA channel stopped. usleep() is rounded up generously
+// by the kernel, so polling with it adds a lot of latency and jitter.
+// Instead, sleep for most of the expected transfer time, then busy-poll.
+// If it takes a lot longer than expected, fall back to polling with sleep
+// to not burn the CPU.
+void DMAMultiSPI::WaitTransferDone() {
+    const uint32_t kWakeupEarlyUsec = 150;  // Covers usleep() overshoot.
+    const uint32_t kMaxSpinUsec = 500;
+    const uint64_t expected_done = transfer_start_usec_
+        + ExpectedTransferUsec();
+    const uint64_t now = MonotonicUsec();
+    if (expected_done > now + kWakeupEarlyUsec) {
+        usleep(expected_done - now - kWakeupEarlyUsec);
+    }
+    const uint64_t spin_until = std::max(now, expected_done) + kMaxSpinUsec;
+    while (ChannelActive() && !ChannelError()) {
+        if (MonotonicUsec() > spin_until) usleep(10);
+    }
+}
+
+// Abort the chain after an error and get the channel ready for the next.
+void DMAMultiSPI::ResetChannel() {
+    if (dma4_) {
+        dma_channel_->cs |= DMA4_CS_ABORT;
+        usleep(100);
+        dma_channel_->cs &= ~DMA4_CS_ACTIVE;
+        *(volatile uint32_t*)((char*)dma_channel_ + DMA4_DEBUG_OFFSET)
+            |= DMA4_DEBUG_RESET;
+    } else {
+        dma_channel_->cs |= DMA_CS_ABORT;
+        usleep(100);
+        dma_channel_->cs &= ~DMA_CS_ACTIVE;
+        dma_channel_->cs |= DMA_CS_RESET;
+    }
+}
+
+void DMAMultiSPI::WaitForCompletion() {
+    if (swap_pending_) {
+        // Buffer to be swapped in was the last filled one.
+        const TransferBuffer *const swapped_in
+            = &buffers_[(next_buffer_ + 1) % 2];
+        while (!IsExecuting(swapped_in) && !ChannelError()) {
+            usleep(10);
+        }
+        if (ChannelError()) stats_.dma_errors++;
+        RecordLatency(send_start_usec_, MonotonicUsec());
+        swap_pending_ = false;
+    }
+    if (continuous_ || !transfer_running_) return;
+    WaitTransferDone();
+    const uint64_t transfer_done = MonotonicUsec();
+
+    // A cleanly finished chain leaves the channel inactive and ready for the
+    // next transfer. Only after an error it needs to be aborted and reset.
+    if (ChannelError()) {
+        stats_.dma_errors++;
+        ResetChannel();
+    }
+    transfer_running_ = false;
+    const uint64_t done = MonotonicUsec();
+    stats_.teardown.Add(done - transfer_done);
+    if (send_start_usec_) {
+        const uint32_t transfer_usec = transfer_done - transfer_start_usec_;
+        stats_.transfer.Add(transfer_usec);
+        RecordClockRate(8 * transfer_bytes_, transfer_usec);
+        // Short transfers are dominated by the overhead of starting and
+        // checking, so don't give a good estimate for longer ones.
+        const uint32_t kMinMeasureUsec = 1000;
+        if (transfer_usec >= kMinMeasureUsec && transfer_bytes_ > 0) {
+            const float byte_usec = (float)transfer_usec / transfer_bytes_;
+            if (!fastest_byte_usec_ || byte_usec < fastest_byte_usec_)
+                fastest_byte_usec_ = byte_usec;
+        }
+        RecordLatency(send_start_usec_, done);
+    }
 }
 
 
 // Public interface
-MultiSPI *CreateDMAMultiSPI(int clock_gpio) {
-    return new DMAMultiSPI(clock_gpio);
+MultiSPI *CreateDMAMultiSPI(int clock_gpio, DMAEncoding encoding,
+                            int speed_khz) {
+    return new DMAMultiSPI(clock_gpio, encoding, speed_khz);
 }
 }  // namespace spixels
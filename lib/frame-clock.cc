@@ -0,0 +1,132 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "frame-clock.h"
+
+#include <errno.h>
+
+#include <algorithm>
+
+namespace spixels {
+static const int64_t kNanosPerSecond = 1000000000LL;
+
+static int64_t ToNanos(const struct timespec &ts) {
+    return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+
+static struct timespec FromNanos(int64_t nanos) {
+    struct timespec result;
+    result.tv_sec = nanos / kNanosPerSecond;
+    result.tv_nsec = nanos % kNanosPerSecond;
+    return result;
+}
+
+static int64_t NowNanos(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return ToNanos(now);
+}
+
+static int64_t Clamp(int64_t value, int64_t lo, int64_t hi) {
+    return std::max(lo, std::min(value, hi));
+}
+
+// The time the deadlines are in.
+static int64_t ScheduleNanos(bool shared_time, int64_t shared_offset_nsec) {
+    return shared_time
+        ? NowNanos(CLOCK_REALTIME) + shared_offset_nsec
+        : NowNanos(CLOCK_MONOTONIC);
+}
+
+FrameClock::FrameClock(float frames_per_second, Policy policy)
+    : period_nsec_(frames_per_second > 0
+                   ? (int64_t)(kNanosPerSecond / frames_per_second) : 0),
+      policy_(policy), started_(false), shared_time_(false),
+      shared_offset_nsec_(0), deadline_monotonic_nsec_(0), frame_number_(0),
+      frames_(0), missed_(0), dropped_(0),
+      max_wakeup_delay_usec_(0), last_skew_usec_(0), max_skew_usec_(0) {
+}
+
+void FrameClock::Reset() {
+    started_ = false;
+}
+
+void FrameClock::SetSharedTime(int64_t offset_nsec) {
+    if (!shared_time_) started_ = false;  // Deadlines are in another time.
+    shared_time_ = true;
+    shared_offset_nsec_ = offset_nsec;
+}
+
+int FrameClock::WaitForNextFrame() {
+    int skipped = 0;
+    const int64_t now = ScheduleNanos(shared_time_, shared_offset_nsec_);
+    int64_t deadline = started_ ? ToNanos(next_deadline_) : now;
+    if (shared_time_ && period_nsec_ > 0
+        && (!started_ || deadline > now + period_nsec_)) {
+        // Next point on the grid.
+        deadline = (now + period_nsec_ - 1) / period_nsec_ * period_nsec_;
+    }
+    started_ = true;
+    ++frames_;
+    // Waking up a bit late is normal, so a frame is only late beyond half
+    // a period. Of the deadlines passed, the one nearest to now is kept.
+    const int64_t slack = period_nsec_ / 2;
+    if (now - deadline > slack) {
+        ++missed_;
+        if (policy_ == DROP_LATE_FRAMES && period_nsec_ > 0) {
+            skipped = (now - deadline - slack + period_nsec_ - 1)
+                / period_nsec_;
+            deadline += skipped * period_nsec_;
+            dropped_ += skipped;
+        }
+    }
+
+    if (deadline > now) {
+        // CLOCK_REALTIME sleeps follow adjustments of the clock.
+        const struct timespec wakeup = shared_time_
+            ? FromNanos(deadline - shared_offset_nsec_)
+            : FromNanos(deadline);
+        const clockid_t clock = shared_time_ ? CLOCK_REALTIME : CLOCK_MONOTONIC;
+        while (clock_nanosleep(clock, TIMER_ABSTIME, &wakeup, NULL)
+               == EINTR) {
+        }
+        const int64_t delay_usec
+            = (ScheduleNanos(shared_time_, shared_offset_nsec_) - deadline)
+            / 1000;
+        if (delay_usec > max_wakeup_delay_usec_)
+            max_wakeup_delay_usec_ = Clamp(delay_usec, 0, 0xFFFFFFFF);
+    }
+    // For the skew, the deadline in the clock the MultiSPI times with.
+    deadline_monotonic_nsec_ = deadline
+        - (ScheduleNanos(shared_time_, shared_offset_nsec_)
+           - NowNanos(CLOCK_MONOTONIC));
+    if (shared_time_ && period_nsec_ > 0)
+        frame_number_ = deadline / period_nsec_;
+    else
+        frame_number_ = frames_ - 1 + dropped_;
+    next_deadline_ = FromNanos(deadline + period_nsec_);
+    return skipped;
+}
+
+void FrameClock::RecordSkew(MultiSPI *spi) {
+    const int64_t skew_usec = (int64_t)spi->GetStats().last_transfer_start_usec
+        - deadline_monotonic_nsec_ / 1000;
+    last_skew_usec_ = Clamp(skew_usec, -0x7FFFFFFF, 0x7FFFFFFF);
+    if (last_skew_usec_ > max_skew_usec_)
+        max_skew_usec_ = last_skew_usec_;
+}
+}  // namespace spixels
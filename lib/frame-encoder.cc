@@ -0,0 +1,168 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "frame-encoder.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace spixels {
+void FrameEncoder::StoreFrame(LEDStrip *strip, const RGBc *frame) {
+    strip->StoreValues(0, frame, strip->count());
+}
+
+namespace {
+class ThreadedFrameEncoder : public FrameEncoder {
+public:
+    explicit ThreadedFrameEncoder(int threads);
+    virtual ~ThreadedFrameEncoder();
+
+    virtual void AddStrip(LEDStrip *strip);
+    virtual void SetFrames(const RGBc *const *frames);
+
+private:
+    struct WorkerArg {
+        ThreadedFrameEncoder *encoder;
+        int index;
+    };
+
+    static void *WorkerMain(void *arg);
+    void Work(int index);
+    void EncodeRange(int index);
+
+    const int threads_;
+    std::vector<LEDStrip*> parallel_;   // Encoded by byte range.
+    std::vector<LEDStrip*> strips_;     // All, in order of AddStrip().
+    size_t serial_bytes_;               // Max PixelDataEnd() of parallel_.
+
+    std::vector<pthread_t> workers_;
+    std::vector<WorkerArg> worker_args_;
+    pthread_mutex_t mutex_;
+    pthread_cond_t work_available_;
+    pthread_cond_t work_done_;
+    unsigned int generation_;           // Incremented for each frame.
+    int busy_workers_;
+    bool shutdown_;
+};
+}  // end anonymous namespace
+
+ThreadedFrameEncoder::ThreadedFrameEncoder(int threads)
+    : threads_(std::max(1, threads)), serial_bytes_(0),
+      generation_(0), busy_workers_(0), shutdown_(false) {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&work_available_, NULL);
+    pthread_cond_init(&work_done_, NULL);
+    // Index 0 is the calling thread.
+    worker_args_.resize(threads_);
+    workers_.resize(threads_);
+    for (int i = 1; i < threads_; ++i) {
+        worker_args_[i].encoder = this;
+        worker_args_[i].index = i;
+        pthread_create(&workers_[i], NULL, &WorkerMain, &worker_args_[i]);
+    }
+}
+
+ThreadedFrameEncoder::~ThreadedFrameEncoder() {
+    pthread_mutex_lock(&mutex_);
+    shutdown_ = true;
+    pthread_cond_broadcast(&work_available_);
+    pthread_mutex_unlock(&mutex_);
+    for (int i = 1; i < threads_; ++i) {
+        pthread_join(workers_[i], NULL);
+    }
+    pthread_cond_destroy(&work_done_);
+    pthread_cond_destroy(&work_available_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+void ThreadedFrameEncoder::AddStrip(LEDStrip *strip) {
+    strips_.push_back(strip);
+    const size_t end = PixelDataEnd(strip);
+    if (end == 0) return;
+    parallel_.push_back(strip);
+    serial_bytes_ = std::max(serial_bytes_, end);
+}
+
+void *ThreadedFrameEncoder::WorkerMain(void *arg) {
+    WorkerArg *const worker = (WorkerArg*) arg;
+    worker->encoder->Work(worker->index);
+    return NULL;
+}
+
+void ThreadedFrameEncoder::Work(int index) {
+    unsigned int seen_generation = 0;
+    for (;;) {
+        pthread_mutex_lock(&mutex_);
+        while (generation_ == seen_generation && !shutdown_) {
+            pthread_cond_wait(&work_available_, &mutex_);
+        }
+        seen_generation = generation_;
+        const bool shutdown = shutdown_;
+        pthread_mutex_unlock(&mutex_);
+        if (shutdown) return;
+
+        EncodeRange(index);
+
+        pthread_mutex_lock(&mutex_);
+        if (--busy_workers_ == 0) pthread_cond_signal(&work_done_);
+        pthread_mutex_unlock(&mutex_);
+    }
+}
+
+void ThreadedFrameEncoder::EncodeRange(int index) {
+    const size_t per_thread = (serial_bytes_ + threads_ - 1) / threads_;
+    const size_t from = index * per_thread;
+    const size_t to = std::min(serial_bytes_, from + per_thread);
+    if (from >= to) return;
+    for (size_t i = 0; i < parallel_.size(); ++i) {
+        EncodeSerialBytes(parallel_[i], from, to);
+    }
+}
+
+void ThreadedFrameEncoder::SetFrames(const RGBc *const *frames) {
+    for (size_t i = 0; i < strips_.size(); ++i) {
+        if (PixelDataEnd(strips_[i]) == 0) {
+            strips_[i]->SetFrame(frames[i]);  // Only serially possible.
+        } else {
+            StoreFrame(strips_[i], frames[i]);
+        }
+    }
+    if (parallel_.empty()) return;
+
+    pthread_mutex_lock(&mutex_);
+    busy_workers_ = threads_ - 1;
+    ++generation_;
+    pthread_cond_broadcast(&work_available_);
+    pthread_mutex_unlock(&mutex_);
+
+    EncodeRange(0);
+
+    pthread_mutex_lock(&mutex_);
+    while (busy_workers_ > 0) {
+        pthread_cond_wait(&work_done_, &mutex_);
+    }
+    pthread_mutex_unlock(&mutex_);
+}
+
+// Public interface
+FrameEncoder *CreateFrameEncoder(int threads) {
+    return new ThreadedFrameEncoder(threads);
+}
+}  // namespace spixels
@@ -0,0 +1,195 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "frame-sender.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+namespace spixels {
+namespace {
+// Atomically replace the value, returning the previous one. Full barrier.
+static int AtomicExchange(volatile int *value, int new_value) {
+    int expected = 0;  // Just a guess, the first swap tells the real value.
+    for (;;) {
+        const int old = __sync_val_compare_and_swap(value, expected, new_value);
+        if (old == expected) return old;
+        expected = old;
+    }
+}
+
+static uint64_t AtomicRead(uint64_t *value) {
+    return __sync_fetch_and_add(value, 0);
+}
+
+class ThreadedFrameSender : public FrameSender {
+public:
+    explicit ThreadedFrameSender(MultiSPI *spi);
+    virtual ~ThreadedFrameSender();
+
+    virtual void AddStrip(LEDStrip *strip);
+    virtual bool Start(int cpu, int realtime_priority);
+    virtual RGBc *GetFrame(int strip_index);
+    virtual void SubmitFrame();
+
+    virtual uint64_t frames_submitted() const {
+        return AtomicRead(&submitted_);
+    }
+    virtual uint64_t frames_sent() const { return AtomicRead(&sent_); }
+    virtual uint64_t frames_dropped() const { return AtomicRead(&dropped_); }
+
+private:
+    // Slot index in 'shared_', together with this flag if it contains a
+    // frame not yet picked up by the output thread.
+    enum { kFresh = 0x4 };
+
+    static void *ThreadMain(void *arg);
+    void Run();
+    RGBc *Slot(int index) { return frames_ + index * pixels_per_frame_; }
+
+    MultiSPI *const spi_;
+    std::vector<LEDStrip*> strips_;
+    std::vector<int> offsets_;   // Start of each strip's pixels in a frame.
+    int pixels_per_frame_;
+    RGBc *frames_;               // Three frames.
+
+    int back_;                   // Slot owned by the producer.
+    int front_;                  // Slot owned by the output thread.
+    volatile int shared_;        // Slot exchanged between the two.
+
+    pthread_t thread_;
+    bool started_;
+    volatile int running_;
+    sem_t frame_submitted_;
+
+    // Counters, only accessed atomically.
+    mutable uint64_t submitted_;
+    mutable uint64_t dropped_;
+    mutable uint64_t sent_;
+};
+}  // end anonymous namespace
+
+ThreadedFrameSender::ThreadedFrameSender(MultiSPI *spi)
+    : spi_(spi), pixels_per_frame_(0), frames_(NULL),
+      back_(0), front_(1), shared_(2), started_(false), running_(0),
+      submitted_(0), dropped_(0), sent_(0) {
+    sem_init(&frame_submitted_, 0, 0);
+}
+
+ThreadedFrameSender::~ThreadedFrameSender() {
+    if (started_) {
+        AtomicExchange(&running_, 0);
+        sem_post(&frame_submitted_);
+        pthread_join(thread_, NULL);
+    }
+    sem_destroy(&frame_submitted_);
+    delete [] frames_;
+}
+
+void ThreadedFrameSender::AddStrip(LEDStrip *strip) {
+    if (started_) {
+        fprintf(stderr, "FrameSender: can't add strips after Start()\n");
+        return;
+    }
+    strips_.push_back(strip);
+    offsets_.push_back(pixels_per_frame_);
+    pixels_per_frame_ += strip->count();
+    delete [] frames_;
+    frames_ = new RGBc[3 * pixels_per_frame_];
+}
+
+bool ThreadedFrameSender::Start(int cpu, int realtime_priority) {
+    if (started_) return true;
+    running_ = 1;
+    if (pthread_create(&thread_, NULL, &ThreadMain, this) != 0) {
+        running_ = 0;
+        return false;
+    }
+    started_ = true;
+
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        const int err = pthread_setaffinity_np(thread_, sizeof(cpus), &cpus);
+        if (err != 0) {
+            fprintf(stderr, "FrameSender: can't pin to CPU %d: %s\n",
+                    cpu, strerror(err));
+        }
+    }
+    if (realtime_priority > 0) {
+        struct sched_param param;
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = realtime_priority;
+        const int err = pthread_setschedparam(thread_, SCHED_FIFO, &param);
+        if (err != 0) {
+            fprintf(stderr, "FrameSender: can't set SCHED_FIFO priority %d: "
+                    "%s\n", realtime_priority, strerror(err));
+        }
+    }
+    return true;
+}
+
+RGBc *ThreadedFrameSender::GetFrame(int strip_index) {
+    if (strip_index < 0 || strip_index >= (int)strips_.size()) return NULL;
+    return Slot(back_) + offsets_[strip_index];
+}
+
+void ThreadedFrameSender::SubmitFrame() {
+    const int previous = AtomicExchange(&shared_, back_ | kFresh);
+    if (previous & kFresh) {
+        __sync_fetch_and_add(&dropped_, 1);  // Was not picked up in time.
+    }
+    back_ = previous & ~kFresh;
+    __sync_fetch_and_add(&submitted_, 1);
+    sem_post(&frame_submitted_);
+}
+
+void *ThreadedFrameSender::ThreadMain(void *arg) {
+    ((ThreadedFrameSender*) arg)->Run();
+    return NULL;
+}
+
+void ThreadedFrameSender::Run() {
+    for (;;) {
+        while (sem_wait(&frame_submitted_) != 0 && errno == EINTR) {}
+        if (!__sync_fetch_and_add(&running_, 0))
+            break;
+        if ((__sync_fetch_and_add(&shared_, 0) & kFresh) == 0)
+            continue;  // Already picked up with a previous wakeup.
+        front_ = AtomicExchange(&shared_, front_) & ~kFresh;
+
+        const RGBc *const frame = Slot(front_);
+        for (size_t i = 0; i < strips_.size(); ++i) {
+            strips_[i]->SetFrame(frame + offsets_[i]);
+        }
+        spi_->SendBuffers();
+        __sync_fetch_and_add(&sent_, 1);
+    }
+}
+
+// Public interface
+FrameSender *CreateFrameSender(MultiSPI *spi) {
+    return new ThreadedFrameSender(spi);
+}
+}  // namespace spixels
@@ -0,0 +1,220 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "frame-sync.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace spixels {
+namespace {
+static const int64_t kNanosPerSecond = 1000000000LL;
+
+// Beacon as sent over the wire, numbers little endian.
+struct BeaconPacket {
+    char magic[8];              // "SPIXSYNC"
+    uint32_t sequence;
+    uint32_t nsec;              // CLOCK_REALTIME of the master when sent.
+    int64_t sec;
+};
+
+static const char kBeaconMagic[8] = { 'S', 'P', 'I', 'X', 'S', 'Y', 'N', 'C' };
+
+static int64_t ToNanos(const struct timespec &ts) {
+    return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+
+static int64_t NowNanos(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return ToNanos(now);
+}
+
+class BeaconSender : public SyncBeacon {
+public:
+    BeaconSender(int fd, const struct sockaddr_in &to)
+        : fd_(fd), to_(to), sequence_(0) {}
+    virtual ~BeaconSender() { close(fd_); }
+
+    virtual bool SendBeacon();
+    virtual bool ReceiveBeacons() { return false; }
+    virtual int64_t offset_nsec() const { return 0; }
+    virtual int64_t jitter_nsec() const { return 0; }
+    virtual bool synchronized() const { return true; }
+
+private:
+    const int fd_;
+    const struct sockaddr_in to_;
+    uint32_t sequence_;
+};
+
+class BeaconReceiver : public SyncBeacon {
+public:
+    explicit BeaconReceiver(int fd);
+    virtual ~BeaconReceiver() { close(fd_); }
+
+    virtual bool SendBeacon() { return false; }
+    virtual bool ReceiveBeacons();
+    virtual int64_t offset_nsec() const { return offset_nsec_; }
+    virtual int64_t jitter_nsec() const { return jitter_nsec_; }
+    virtual bool synchronized() const;
+
+private:
+    enum {
+        kWindow = 16,           // Recent offsets to estimate from.
+    };
+
+    void AddSample(int64_t offset);
+
+    const int fd_;
+    int64_t samples_[kWindow];
+    int sample_count_;
+    int next_sample_;
+    int64_t offset_nsec_;
+    int64_t jitter_nsec_;
+    int64_t last_beacon_nsec_;  // CLOCK_MONOTONIC
+};
+}  // end anonymous namespace
+
+bool BeaconSender::SendBeacon() {
+    BeaconPacket packet;
+    memcpy(packet.magic, kBeaconMagic, sizeof(packet.magic));
+    packet.sequence = htole32(sequence_++);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    packet.sec = htole64(now.tv_sec);
+    packet.nsec = htole32(now.tv_nsec);
+    if (sendto(fd_, &packet, sizeof(packet), 0,
+               (const struct sockaddr*)&to_, sizeof(to_)) < 0) {
+        perror("sendto()");
+        return false;
+    }
+    return true;
+}
+
+BeaconReceiver::BeaconReceiver(int fd)
+    : fd_(fd), sample_count_(0), next_sample_(0),
+      offset_nsec_(0), jitter_nsec_(0), last_beacon_nsec_(0) {
+}
+
+bool BeaconReceiver::ReceiveBeacons() {
+    bool received = false;
+    for (;;) {
+        BeaconPacket packet;
+        struct iovec iov;
+        iov.iov_base = &packet;
+        iov.iov_len = sizeof(packet);
+        char control[CMSG_SPACE(sizeof(struct timespec))];
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        const ssize_t len = recvmsg(fd_, &message, MSG_DONTWAIT);
+        if (len < 0) break;  // Nothing left (or an error, same to us).
+        if (len != sizeof(packet)
+            || memcmp(packet.magic, kBeaconMagic, sizeof(kBeaconMagic)) != 0)
+            continue;
+
+        // Time of arrival, as taken by the kernel.
+        int64_t arrival = 0;
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&message); c != NULL;
+             c = CMSG_NXTHDR(&message, c)) {
+            if (c->cmsg_level == SOL_SOCKET
+                && c->cmsg_type == SCM_TIMESTAMPNS) {
+                struct timespec ts;
+                memcpy(&ts, CMSG_DATA(c), sizeof(ts));
+                arrival = ToNanos(ts);
+            }
+        }
+        if (!arrival) arrival = NowNanos(CLOCK_REALTIME);
+        const int64_t sent = (int64_t)le64toh(packet.sec) * kNanosPerSecond
+            + le32toh(packet.nsec);
+        AddSample(sent - arrival);
+        received = true;
+    }
+    if (received) last_beacon_nsec_ = NowNanos(CLOCK_MONOTONIC);
+    return received;
+}
+
+// The beacons only ever arrive late, so the largest offset is the one with
+// the least delay.
+void BeaconReceiver::AddSample(int64_t offset) {
+    samples_[next_sample_] = offset;
+    next_sample_ = (next_sample_ + 1) % kWindow;
+    sample_count_ = std::min(sample_count_ + 1, (int)kWindow);
+    int64_t *const end = samples_ + sample_count_;
+    offset_nsec_ = *std::max_element(samples_, end);
+    jitter_nsec_ = offset_nsec_ - *std::min_element(samples_, end);
+}
+
+bool BeaconReceiver::synchronized() const {
+    return sample_count_ > 0
+        && NowNanos(CLOCK_MONOTONIC) - last_beacon_nsec_ < kNanosPerSecond;
+}
+
+// Public interface
+SyncBeacon *CreateSyncBeaconSender(const char *broadcast_address, int port) {
+    struct sockaddr_in to;
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_port = htons(port);
+    if (inet_aton(broadcast_address, &to.sin_addr) == 0) {
+        fprintf(stderr, "Invalid address %s\n", broadcast_address);
+        return NULL;
+    }
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket()");
+        return NULL;
+    }
+    const int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable));
+    return new BeaconSender(fd, to);
+}
+
+SyncBeacon *CreateSyncBeaconReceiver(int port) {
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket()");
+        return NULL;
+    }
+    const int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind()");
+        close(fd);
+        return NULL;
+    }
+    return new BeaconReceiver(fd);
+}
+}  // namespace spixels
@@ -66,8 +66,9 @@ bool GPIO::AddOutput(int bit) {
         return 0;
     }
 
+    if (bit < 0 || bit > 31) return false;
     const uint32_t gpio_mask = 1 << bit;
-    if (bit < 0 || ((gpio_mask & kValidBits) == 0))
+    if ((gpio_mask & kValidBits) == 0)
         return false;
     INP_GPIO(bit);   // for writing, we first need to set as input.
     OUT_GPIO(bit);
@@ -76,15 +77,6 @@ bool GPIO::AddOutput(int bit) {
     return true;
 }
 
-// We are not interested in the _exact_ model, just good enough to determine
-// What to do.
-enum RaspberryPiModel {
-  PI_MODEL_1,
-  PI_MODEL_2,
-  PI_MODEL_3,
-  PI_MODEL_4
-};
-
 static int ReadFileToBuffer(char *buffer, size_t size, const char *filename) {
   const int fd = open(filename, O_RDONLY);
   if (fd < 0) return -1;
@@ -136,12 +128,12 @@ static RaspberryPiModel DetermineRaspberryModel() {
   }
 }
 
-static RaspberryPiModel GetPiModel() {
+// Public interface
+RaspberryPiModel GetPiModel() {
   static RaspberryPiModel pi_model = DetermineRaspberryModel();
   return pi_model;
 }
 
-// Public interface
 uint32_t *mmap_bcm_register(off_t register_offset) {
     off_t base = BCM2709_PERI_BASE;  // safe fallback guess.
     switch (GetPiModel()) {
@@ -24,6 +24,18 @@
 // Putting this in our namespace to not collide with other things called like
 // this.
 namespace ft {
+// We are not interested in the _exact_ model, just good enough to determine
+// What to do.
+enum RaspberryPiModel {
+  PI_MODEL_1,
+  PI_MODEL_2,
+  PI_MODEL_3,
+  PI_MODEL_4
+};
+
+// Return the model of the Raspberry Pi we're running on.
+RaspberryPiModel GetPiModel();
+
 // Memory map a bcm register. Takes care of detecting the right Raspberry Pi
 uint32_t *mmap_bcm_register(off_t register_offset);
 
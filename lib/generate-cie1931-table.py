@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# -*- mode: python; -*-
+# SPI Pixels - Control SPI LED strips (spixels)
+# Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+#
+# This library is free software: you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+# Generates cie1931-table.h, the CIE1931 luminance correction at full
+# brightness. Re-run after changing the formula:
+#   ./generate-cie1931-table.py > cie1931-table.h
+#
+# Needs to produce exactly the values of luminance_cie1931_internal() in
+# led-strip.cc, so the float (32 bit) arithmetic there is emulated here.
+
+import struct
+
+def f32(x):
+    return struct.unpack('f', struct.pack('f', x))[0]
+
+def luminance_cie1931(c, brightness):
+    v = f32(f32(100.0 * f32(brightness / 255.0)) * f32(c / 255.0))
+    lum = v / 902.3 if v <= 8 else pow((v + 16) / 116.0, 3)
+    return int(f32(0xFFFF) * lum)
+
+values = [luminance_cie1931(c, 255) for c in range(256)]
+
+print("""// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// Generated by generate-cie1931-table.py. Do not edit.
+
+#ifndef SPIXELS_CIE1931_TABLE_H
+#define SPIXELS_CIE1931_TABLE_H
+
+#include <stdint.h>
+
+// CIE1931 corrected values for luminance values 0..255 at full brightness.
+static const uint16_t kCIE1931FullBrightness[256] = {""")
+for row in range(0, 256, 8):
+    print("   " + "".join(" %5d," % v for v in values[row:row+8]))
+print("""};
+
+#endif  // SPIXELS_CIE1931_TABLE_H""")
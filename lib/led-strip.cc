@@ -18,9 +18,18 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define SPIXELS_HAVE_NEON 1
+#endif
 
 #include "multi-spi.h"
 #include "led-strip.h"
+#include "cie1931-table.h"
 
 typedef uint16_t CIEValue;
 
@@ -31,201 +40,581 @@ static CIEValue luminance_cie1931_internal(uint8_t c, uint8_t brightness) {
     return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
 }
 
-static CIEValue *CreateCIE1931LookupTable() {
-    CIEValue *result = new CIEValue[256 * 256];
-    for (int v = 0; v < 256; ++v) {      // Value
-        for (int b = 0; b < 256; ++b) {  // Brightness
-            result[b * 256 + v] = luminance_cie1931_internal(v, b);
+// Return the lookup table for given brightness: 256 CIE1931 corrected values
+// for the desired luminance values.
+// Full brightness is the common case and comes precomputed. Rows for other
+// brightness values are only calculated when first needed, so there is no
+// startup cost and only the rows in use occupy memory and cache.
+static const CIEValue *luminance_cie1931_row(uint8_t bright) {
+    if (bright == 255) return kCIE1931FullBrightness;
+    static CIEValue lookup[255][256];
+    static bool lookup_valid[255];
+    CIEValue *const row = lookup[bright];
+    if (!lookup_valid[bright]) {
+        for (int v = 0; v < 256; ++v) {
+            row[v] = luminance_cie1931_internal(v, bright);
         }
+        lookup_valid[bright] = true;
     }
-    return result;
-}
-
-// Return a CIE1931 corrected value from given desired lumninace value and
-// brightness.
-static CIEValue luminance_cie1931(uint8_t value, uint8_t bright) {
-    static const CIEValue *const luminance_lookup = CreateCIE1931LookupTable();
-    return luminance_lookup[bright * 256 + value];
+    return row;
 }
 
 namespace spixels {
 LEDStrip::LEDStrip(int count)
-    : count_(count), values_(new RGBc[count]), brightness_(255) {
+    : count_(count), values_(new RGBc[count]), brightness_(255),
+      changed_end_(count), linear_end_(0) {
 }
 
-LEDStrip::~LEDStrip() { delete values_; }
+LEDStrip::~LEDStrip() { delete [] values_; }
 
 void LEDStrip::SetPixel(int pos, const RGBc& c) {
     if (pos < 0 || pos >= count()) return;
-    values_[pos] = c;
-    SetLinearValues(pos,
-                    luminance_cie1931(c.r, brightness_),
-                    luminance_cie1931(c.g, brightness_),
-                    luminance_cie1931(c.b, brightness_));
+    StoreValues(pos, &c, 1);
+    EncodePixels(pos, 1);
+}
+
+void LEDStrip::SetPixels(int start, const RGBc *colors, int n) {
+    if (start < 0) {
+        colors -= start;
+        n += start;
+        start = 0;
+    }
+    if (start + n > count_) n = count_ - start;
+    if (n <= 0) return;
+    StoreAndEncodePixels(start, colors, n);
+}
+
+void LEDStrip::SetLinearPixels(int start, const uint16_t *rgb, int n) {
+    if (start < 0) {
+        rgb -= 3 * start;
+        n += start;
+        start = 0;
+    }
+    if (start + n > count_) n = count_ - start;
+    if (n <= 0) return;
+    EncodeLinearPixels(start, rgb, n);
+}
+
+void LEDStrip::StoreAndEncodePixels(int start, const RGBc *colors, int n) {
+    StoreValues(start, colors, n);
+    EncodePixels(start, n);
+}
+
+void LEDStrip::StoreOverLinear(int start, int n) {
+    if (start < linear_end_) {
+        changed_end_ = std::max(changed_end_, std::min(start + n, linear_end_));
+        if (start == 0 && n >= linear_end_) linear_end_ = 0;
+    }
+}
+
+void LEDStrip::StoreValues(int start, const RGBc *colors, int n) {
+    StoreOverLinear(start, n);
+    if (start + n > changed_end_) {
+        // Only the last change matters, so look from the end.
+        const RGBc *const stored = values_ + start;
+        for (int i = n - 1; i >= 0 && start + i >= changed_end_; --i) {
+            if (colors[i].r != stored[i].r || colors[i].g != stored[i].g
+                || colors[i].b != stored[i].b) {
+                changed_end_ = start + i + 1;
+                break;
+            }
+        }
+    }
+    memcpy(values_ + start, colors, n * sizeof(RGBc));
 }
 
 void LEDStrip::SetBrightness(uint8_t new_brightness) {
     if (new_brightness == brightness_) return;
     brightness_ = new_brightness;
-    for (int i = 0; i < count_; ++i) {
-        SetPixel(i, values_[i]);  // Force recalculation.
-    }
+    luminance_cie1931_row(brightness_);  // Prepare now, not in encode threads
+    InvalidateAllPixels();  // Force recalculation.
+    changed_end_ = count_;
 }
 
-namespace {
-class WS2801LedStrip : public LEDStrip {
-public:
-    WS2801LedStrip(MultiSPI *spi, int gpio, int count)
-        : LEDStrip(count), spi_(spi), gpio_(gpio) {
-        spi_->RegisterDataGPIO(gpio, count * 3);
+void LEDStrip::EncodePixels(int start, int n) {
+    const CIEValue *const cie = luminance_cie1931_row(brightness_);
+    for (const RGBc *c = values_ + start; n; --n, ++c, ++start) {
+        SetLinearValues(start, cie[c->r], cie[c->g], cie[c->b]);
     }
+}
 
-    virtual void SetLinearValues(int pos, uint16_t r, uint16_t g, uint16_t b) {
-        spi_->SetBufferedByte(gpio_, 3 * pos + 0, r >> 8);
-        spi_->SetBufferedByte(gpio_, 3 * pos + 1, g >> 8);
-        spi_->SetBufferedByte(gpio_, 3 * pos + 2, b >> 8);
+void LEDStrip::EncodeLinearPixels(int start, const uint16_t *rgb, int n) {
+    for (; n; --n, rgb += 3, ++start) {
+        SetLinearValues(start, rgb[0], rgb[1], rgb[2]);
     }
+}
 
-private:
-    MultiSPI *const spi_;
-    const int gpio_;
+namespace {
+// Each chip is described by a traits struct, all decided at compile time:
+//   kStartBytes     Number of start-frame bytes (0x00) before the pixels.
+//   kBytesPerPixel  Number of bytes per pixel on the wire.
+//   kEndByte        Value of the end-frame bytes after the pixels.
+//   EndBytes(count) Number of end-frame bytes needed for 'count' pixels.
+//   kLatchOnPause   Latches on a clock pause instead of end-frame bytes, so
+//                   a partial send has to stop at a pixel boundary.
+//   Encode()        Convert linear 16 bit r,g,b into the pixel bytes; this
+//                   determines channel order and bit depth.
+//   Encode8()       With NEON: the same for eight pixels, as loaded by
+//                   vld3q_u16() into r, g and b lanes.
+
+struct WS2801 {
+    static const int kStartBytes = 0;
+    static const int kBytesPerPixel = 3;
+    static const uint8_t kEndByte = 0x00;
+    static size_t EndBytes(int) { return 0; }
+    static const bool kLatchOnPause = true;
+
+    static inline void Encode(uint16_t r, uint16_t g, uint16_t b,
+                              uint8_t *out) {
+        out[0] = r >> 8;
+        out[1] = g >> 8;
+        out[2] = b >> 8;
+    }
+#ifdef SPIXELS_HAVE_NEON
+    static inline void Encode8(const uint16x8x3_t &c, uint8_t *out) {
+        uint8x8x3_t bytes;
+        bytes.val[0] = vshrn_n_u16(c.val[0], 8);
+        bytes.val[1] = vshrn_n_u16(c.val[1], 8);
+        bytes.val[2] = vshrn_n_u16(c.val[2], 8);
+        vst3_u8(out, bytes);
+    }
+#endif
 };
 
-class LPD6803LedStrip : public LEDStrip {
-public:
-    LPD6803LedStrip(MultiSPI *spi, int gpio, int count)
-        : LEDStrip(count), spi_(spi), gpio_(gpio) {
-        const size_t bytes_needed = 4 + 2 * count + 4;
-        spi_->RegisterDataGPIO(gpio, bytes_needed);
+// 18 channel constant current driver; same wire-format as the WS2801, each
+// group of three outputs being one pixel.
+struct WS2803 : public WS2801 {};
 
-        // Four zero bytes as start-bytes for lpd6803
-        spi_->SetBufferedByte(gpio_, 0, 0x00);
-        spi_->SetBufferedByte(gpio_, 1, 0x00);
-        spi_->SetBufferedByte(gpio_, 2, 0x00);
-        spi_->SetBufferedByte(gpio_, 3, 0x00);
-        for (int pos = 0; pos < count; ++pos) {
-            SetPixel(pos, 0x000000);     // Initialize all top-bits.
-        }
-    }
+struct LPD6803 {
+    static const int kStartBytes = 4;
+    static const int kBytesPerPixel = 2;
+    static const uint8_t kEndByte = 0x00;
+    static size_t EndBytes(int) { return 4; }
+    static const bool kLatchOnPause = false;
 
-    virtual void SetLinearValues(int pos, uint16_t r, uint16_t g, uint16_t b) {
+    static inline void Encode(uint16_t r, uint16_t g, uint16_t b,
+                              uint8_t *out) {
         uint16_t data = 0;
         data |= (1<<15);  // start bit
         data |= (r >> 11) << 10;
         data |= (g >> 11) <<  5;
         data |= (b >> 11) <<  0;
+        out[0] = data >> 8;
+        out[1] = data & 0xFF;
+    }
+#ifdef SPIXELS_HAVE_NEON
+    static inline void Encode8(const uint16x8x3_t &c, uint8_t *out) {
+        uint16x8_t data = vdupq_n_u16(1<<15);
+        data = vorrq_u16(data, vshlq_n_u16(vshrq_n_u16(c.val[0], 11), 10));
+        data = vorrq_u16(data, vshlq_n_u16(vshrq_n_u16(c.val[1], 11), 5));
+        data = vorrq_u16(data, vshrq_n_u16(c.val[2], 11));
+        // Most significant byte first.
+        vst1q_u8(out, vrev16q_u8(vreinterpretq_u8_u16(data)));
+    }
+#endif
+};
 
-        spi_->SetBufferedByte(gpio_, 2 * pos + 4 + 0, data >> 8);
-        spi_->SetBufferedByte(gpio_, 2 * pos + 4 + 1, data & 0xFF);
+struct LPD8806 {
+    static const int kStartBytes = 0;
+    static const int kBytesPerPixel = 3;
+    static const uint8_t kEndByte = 0x00;
+    static size_t EndBytes(int count) { return (count+31)/32; }  // Latch
+    static const bool kLatchOnPause = false;
+
+    static inline void Encode(uint16_t r, uint16_t g, uint16_t b,
+                              uint8_t *out) {
+        out[0] = (b >> 9) | 0x80;
+        out[1] = (r >> 9) | 0x80;
+        out[2] = (g >> 9) | 0x80;
+    }
+#ifdef SPIXELS_HAVE_NEON
+    static inline void Encode8(const uint16x8x3_t &c, uint8_t *out) {
+        const uint8x8_t high_bit = vdup_n_u8(0x80);
+        uint8x8x3_t bytes;
+        // Narrowing shifts only go up to 8 bits.
+        bytes.val[0] = vorr_u8(vmovn_u16(vshrq_n_u16(c.val[2], 9)), high_bit);
+        bytes.val[1] = vorr_u8(vmovn_u16(vshrq_n_u16(c.val[0], 9)), high_bit);
+        bytes.val[2] = vorr_u8(vmovn_u16(vshrq_n_u16(c.val[1], 9)), high_bit);
+        vst3_u8(out, bytes);
     }
+#endif
+};
 
-private:
-    MultiSPI *const spi_;
-    const int gpio_;
+struct APA102 {
+    static const int kStartBytes = 4;
+    static const int kBytesPerPixel = 4;
+    static const uint8_t kEndByte = 0xff;
+    // We need a couple of more bits clocked at the end.
+    static size_t EndBytes(int count) { return (count+15) / 16; }
+    static const bool kLatchOnPause = false;
+
+    static inline void Encode(uint16_t r, uint16_t g, uint16_t b,
+                              uint8_t *out) {
+        r >>= 4; g >>= 4; b >>= 4;
+
+        // If value is dim, use the APA global brightness adjustment for
+        // more resolution. We essentially get 4 bits at the bottom end:
+        // each bit less used in the 12 bit value halves the global
+        // brightness, down to 1/31, instead of being shifted out.
+        // Computed without branches, as the values are all over the place.
+        const int bits = 32 - __builtin_clz(r | g | b | 1);  // highest used
+        const int shift = std::min(std::max(bits - 4, 0), 4);
+        out[0] = 0xE0 | ((2 << shift) - 1);
+        out[1] = b >> shift;
+        out[2] = g >> shift;
+        out[3] = r >> shift;
+    }
+#ifdef SPIXELS_HAVE_NEON
+    static inline void Encode8(const uint16x8x3_t &c, uint8_t *out) {
+        const uint16x8_t r = vshrq_n_u16(c.val[0], 4);
+        const uint16x8_t g = vshrq_n_u16(c.val[1], 4);
+        const uint16x8_t b = vshrq_n_u16(c.val[2], 4);
+        const uint16x8_t bits = vsubq_u16(
+            vdupq_n_u16(16), vclzq_u16(vorrq_u16(vorrq_u16(r, g), b)));
+        const int16x8_t shift = vreinterpretq_s16_u16(
+            vminq_u16(vqsubq_u16(bits, vdupq_n_u16(4)), vdupq_n_u16(4)));
+        const int16x8_t right = vnegq_s16(shift);
+        const uint16x8_t global = vsubq_u16(
+            vshlq_u16(vdupq_n_u16(2), shift), vdupq_n_u16(1));
+        uint8x8x4_t bytes;
+        bytes.val[0] = vorr_u8(vmovn_u16(global), vdup_n_u8(0xE0));
+        bytes.val[1] = vmovn_u16(vshlq_u16(b, right));
+        bytes.val[2] = vmovn_u16(vshlq_u16(g, right));
+        bytes.val[3] = vmovn_u16(vshlq_u16(r, right));
+        vst4_u8(out, bytes);
+    }
+#endif
 };
 
-class LPD8806LedStrip : public LEDStrip {
+// Looks like an APA102 on the wire, but the global 5 bit field sets the
+// LED current instead of an extra PWM stage, so is not linear. We always
+// use full current and the 8 bit PWM. The data is only latched with the
+// following clocks, so we need a full zero frame plus one bit per two LEDs.
+struct SK9822 {
+    static const int kStartBytes = 4;
+    static const int kBytesPerPixel = 4;
+    static const uint8_t kEndByte = 0x00;
+    static size_t EndBytes(int count) { return 4 + (count+15) / 16; }
+    static const bool kLatchOnPause = false;
+
+    static inline void Encode(uint16_t r, uint16_t g, uint16_t b,
+                              uint8_t *out) {
+        out[0] = 0xE0 | 0x1F;
+        out[1] = b >> 8;
+        out[2] = g >> 8;
+        out[3] = r >> 8;
+    }
+#ifdef SPIXELS_HAVE_NEON
+    static inline void Encode8(const uint16x8x3_t &c, uint8_t *out) {
+        uint8x8x4_t bytes;
+        bytes.val[0] = vdup_n_u8(0xE0 | 0x1F);
+        bytes.val[1] = vshrn_n_u16(c.val[2], 8);
+        bytes.val[2] = vshrn_n_u16(c.val[1], 8);
+        bytes.val[3] = vshrn_n_u16(c.val[0], 8);
+        vst4_u8(out, bytes);
+    }
+#endif
+};
+
+// Also known as 'Total Control Lighting'. Each pixel starts with a flag
+// byte containing the inverted two top bits of each color as checksum.
+struct P9813 {
+    static const int kStartBytes = 4;
+    static const int kBytesPerPixel = 4;
+    static const uint8_t kEndByte = 0x00;
+    static size_t EndBytes(int) { return 4; }
+    static const bool kLatchOnPause = false;
+
+    static inline void Encode(uint16_t r, uint16_t g, uint16_t b,
+                              uint8_t *out) {
+        r >>= 8; g >>= 8; b >>= 8;
+        const uint8_t top_bits = (b >> 6) << 4 | (g >> 6) << 2 | (r >> 6);
+        out[0] = 0xC0 | (~top_bits & 0x3F);
+        out[1] = b;
+        out[2] = g;
+        out[3] = r;
+    }
+#ifdef SPIXELS_HAVE_NEON
+    static inline void Encode8(const uint16x8x3_t &c, uint8_t *out) {
+        uint8x8x4_t bytes;
+        bytes.val[1] = vshrn_n_u16(c.val[2], 8);
+        bytes.val[2] = vshrn_n_u16(c.val[1], 8);
+        bytes.val[3] = vshrn_n_u16(c.val[0], 8);
+        const uint8x8_t top_bits = vorr_u8(
+            vorr_u8(vshl_n_u8(vshr_n_u8(bytes.val[1], 6), 4),
+                    vshl_n_u8(vshr_n_u8(bytes.val[2], 6), 2)),
+            vshr_n_u8(bytes.val[3], 6));
+        bytes.val[0] = vorr_u8(vdup_n_u8(0xC0),
+                               vbic_u8(vdup_n_u8(0x3F), top_bits));
+        vst4_u8(out, bytes);
+    }
+#endif
+};
+
+// Encode "n" pixels of linear r, g, b values into "out", eight at a time
+// with the vectorized Chip::Encode8() where available.
+template <class Chip>
+static inline void EncodeLinear(const uint16_t *rgb, int n, uint8_t *out) {
+#ifdef SPIXELS_HAVE_NEON
+    for (; n >= 8; n -= 8, rgb += 3 * 8, out += 8 * Chip::kBytesPerPixel) {
+        Chip::Encode8(vld3q_u16(rgb), out);
+    }
+#endif
+    for (; n; --n, rgb += 3, out += Chip::kBytesPerPixel) {
+        Chip::Encode(rgb[0], rgb[1], rgb[2], out);
+    }
+}
+
+// An LED strip speaking the protocol described by the Chip traits.
+// A full re-encode, e.g. due to a brightness change, is deferred until right
+// before the next send, so it happens at most once per frame.
+//
+// With partial sends, the pixels up to the last changed one are sent. Unless
+// the chip latches on a pause, we then need an end-frame: it is written with
+// zero bytes over the pixel data that is not sent, and the pixel data
+// restored after the send. Zero bytes are never taken as pixel data.
+template <class Chip>
+class ProtocolStrip : public LEDStrip, private MultiSPI::SendListener {
 public:
-    LPD8806LedStrip(MultiSPI *spi, int gpio, int count)
-        : LEDStrip(count), spi_(spi), gpio_(gpio) {
-        const size_t data_bytes = 3 * count;
-        const size_t latch_bytes = (count+31)/32;
-        const size_t bytes_needed = data_bytes + latch_bytes;
+    ProtocolStrip(MultiSPI *spi, int gpio, int count)
+        : LEDStrip(count), spi_(spi), gpio_(gpio), encode_pending_(false),
+          restore_from_(0), restore_to_(0) {
+        const size_t data_end = DataEnd(count);
+        const size_t bytes_needed = SendLength(count);
         spi_->RegisterDataGPIO(gpio, bytes_needed);
 
-	for (size_t i = 0; i < bytes_needed; ++i) {
+        for (int i = 0; i < Chip::kStartBytes; ++i) {
             spi_->SetBufferedByte(gpio_, i, 0x00);
         }
-
-        for (int pos = 0; pos < count; ++pos) {
-            SetPixel(pos, 0x000000);     // Initialize all top-bits.
+        EncodePixels(0, count);  // Make sure all start bits are set.
+        for (size_t tail = data_end; tail < bytes_needed; ++tail) {
+            spi_->SetBufferedByte(gpio_, tail, Chip::kEndByte);
         }
+        spi_->AddSendListener(this);
     }
 
+    virtual ~ProtocolStrip() { spi_->RemoveSendListener(this); }
+
     virtual void SetLinearValues(int pos, uint16_t r, uint16_t g, uint16_t b) {
-        spi_->SetBufferedByte(gpio_, 3 * pos + 0, (b >> 9) | 0x80);
-        spi_->SetBufferedByte(gpio_, 3 * pos + 1, (r >> 9) | 0x80);
-        spi_->SetBufferedByte(gpio_, 3 * pos + 2, (g >> 9) | 0x80);
+        uint8_t data[Chip::kBytesPerPixel];
+        Chip::Encode(r, g, b, data);
+        spi_->SetBufferedBytes(gpio_, DataEnd(pos), data,
+                               Chip::kBytesPerPixel);
+        if (pos >= changed_end_) changed_end_ = pos + 1;
+        if (pos >= linear_end_) linear_end_ = pos + 1;
     }
 
-private:
-    MultiSPI *const spi_;
-    const int gpio_;
-};
+protected:
+    virtual void InvalidateAllPixels() { encode_pending_ = true; }
 
+    virtual void EncodePixels(int start, int n) {
+        EncodeClipped(start, n, 0, PixelDataEnd());
+    }
 
-class APA102LedStrip : public LEDStrip {
-public:
-    APA102LedStrip(MultiSPI *spi, int gpio, int count)
-        : LEDStrip(count), spi_(spi), gpio_(gpio) {
-        const size_t startframe_size = 4;
-        const size_t endframe_size = (count+15) / 16;
-        const size_t bytes_needed = startframe_size + 4*count + endframe_size;
+    // Encode the new colors straight into the serial bytes, storing them
+    // and looking for changes in the same pass.
+    virtual void StoreAndEncodePixels(int start, const RGBc *colors, int n) {
+        StoreOverLinear(start, n);
+        const CIEValue *const cie = luminance_cie1931_row(brightness_);
+        uint8_t buffer[kChunkPixels * Chip::kBytesPerPixel];
+        int changed_end = 0;
+        for (int done = 0; done < n; done += kChunkPixels) {
+            const int chunk_end = std::min(n, done + (int)kChunkPixels);
+            uint8_t *out = buffer;
+            int i = done;
+#ifdef SPIXELS_HAVE_NEON
+            for (; i + 8 <= chunk_end; i += 8) {
+                uint16_t linear[3 * 8];
+                for (int j = 0; j < 8; ++j) {
+                    const RGBc &c = colors[i + j];
+                    const int pos = start + i + j;
+                    if (Store(pos, c)) changed_end = pos + 1;
+                    linear[3 * j + 0] = cie[c.r];
+                    linear[3 * j + 1] = cie[c.g];
+                    linear[3 * j + 2] = cie[c.b];
+                }
+                Chip::Encode8(vld3q_u16(linear), out);
+                out += 8 * Chip::kBytesPerPixel;
+            }
+#endif
+            for (; i < chunk_end; ++i, out += Chip::kBytesPerPixel) {
+                const RGBc &c = colors[i];
+                if (Store(start + i, c)) changed_end = start + i + 1;
+                Chip::Encode(cie[c.r], cie[c.g], cie[c.b], out);
+            }
+            spi_->SetBufferedBytes(gpio_, DataEnd(start + done), buffer,
+                                   out - buffer);
+        }
+        changed_end_ = std::max(changed_end_, changed_end);
+    }
 
-        spi_->RegisterDataGPIO(gpio, bytes_needed);
+    virtual void EncodeLinearPixels(int start, const uint16_t *rgb, int n) {
+        const int end = start + n;
+        while (n > 0) {
+            const int chunk = n < kChunkPixels ? n : kChunkPixels;
+            WriteLinear(start, rgb, chunk, 0, PixelDataEnd());
+            rgb += 3 * chunk;
+            start += chunk;
+            n -= chunk;
+        }
+        changed_end_ = std::max(changed_end_, end);
+        linear_end_ = std::max(linear_end_, end);
+    }
+
+    virtual size_t PixelDataEnd() const { return DataEnd(count_); }
+
+    virtual void EncodeSerialBytes(size_t from, size_t to) {
+        if (from < (size_t)Chip::kStartBytes) from = Chip::kStartBytes;
+        if (to > PixelDataEnd()) to = PixelDataEnd();
+        if (from >= to) return;
+        const int first = (from - Chip::kStartBytes) / Chip::kBytesPerPixel;
+        const int end = (to - Chip::kStartBytes + Chip::kBytesPerPixel - 1)
+            / Chip::kBytesPerPixel;
+        EncodeClipped(first, end - first, from, to);
+    }
 
-        // Four zero bytes as start-bytes
-        spi_->SetBufferedByte(gpio_, 0, 0x00);
-        spi_->SetBufferedByte(gpio_, 1, 0x00);
-        spi_->SetBufferedByte(gpio_, 2, 0x00);
-        spi_->SetBufferedByte(gpio_, 3, 0x00);
+private:
+    // End of the serial bytes of the first "pixels" pixels, and the bytes
+    // needed to send them including the end-frame.
+    static size_t DataEnd(int pixels) {
+        return Chip::kStartBytes + Chip::kBytesPerPixel * pixels;
+    }
+    static size_t SendLength(int pixels) {
+        return DataEnd(pixels) + Chip::EndBytes(pixels);
+    }
 
-        // Make sure the start bits are properly set.
-        for (int i = 0; i < count; ++i) {
-            SetPixel(i, 0x000000);
+    enum { kChunkPixels = 64 };
+
+    // Encode a range of pixels in chunks: luminance corrected into a local
+    // buffer of linear values, then in bulk with WriteLinear(). Only the
+    // serial bytes within [from, to) are written.
+    void EncodeClipped(int start, int n, size_t from, size_t to) {
+        const CIEValue *const cie = luminance_cie1931_row(brightness_);
+        uint16_t linear[3 * kChunkPixels];
+        const RGBc *values = values_ + start;
+        while (n > 0) {
+            const int chunk = n < kChunkPixels ? n : kChunkPixels;
+            uint16_t *out = linear;
+            for (int i = 0; i < chunk; ++i, out += 3) {
+                const RGBc &c = values[i];
+                out[0] = cie[c.r];
+                out[1] = cie[c.g];
+                out[2] = cie[c.b];
+            }
+            WriteLinear(start, linear, chunk, from, to);
+            values += chunk;
+            start += chunk;
+            n -= chunk;
         }
+    }
+
+    // Store "c" as value of pixel "pos"; returns if that changed it.
+    bool Store(int pos, const RGBc &c) {
+        RGBc &stored = values_[pos];
+        const bool changed = c.r != stored.r || c.g != stored.g
+            || c.b != stored.b;
+        stored = c;
+        return changed;
+    }
 
-        // We need a couple of more bits clocked at the end.
-        for (size_t tail = 4 + 4*count; tail < bytes_needed; ++tail) {
-            spi_->SetBufferedByte(gpio_, tail, 0xff);
+    // Encode up to kChunkPixels linear pixels into a local buffer and write
+    // the serial bytes of it within [from, to) to the SPI buffer.
+    void WriteLinear(int start, const uint16_t *rgb, int n,
+                     size_t from, size_t to) {
+        uint8_t buffer[kChunkPixels * Chip::kBytesPerPixel];
+        EncodeLinear<Chip>(rgb, n, buffer);
+        size_t pos = Chip::kStartBytes + start * Chip::kBytesPerPixel;
+        size_t len = n * Chip::kBytesPerPixel;
+        const uint8_t *data = buffer;
+        if (pos < from) {
+            data += from - pos;
+            len -= from - pos;
+            pos = from;
         }
+        if (pos + len > to) len = to - pos;
+        spi_->SetBufferedBytes(gpio_, pos, data, len);
     }
 
-    virtual void SetLinearValues(int pos, uint16_t r, uint16_t g, uint16_t b) {
-        const int base = 4 + 4 * pos;
-        r >>= 4; g >>= 4; b >>= 4;
+    virtual void OnBeforeSend() {
+        if (!encode_pending_) return;
+        EncodePixels(0, count_);
+        encode_pending_ = false;
+        linear_end_ = 0;
+    }
 
-        // If value is dim, use the APA global brightness adjustment for
-        // more resolution. We essentially get 4 bits at the bottom end.
-        const uint16_t bit_use = r | g | b;  // find highest bit used.
-        if (bit_use < 16) {
-            spi_->SetBufferedByte(gpio_, base + 0, 0xE0 | 0x01);
-        } else if (bit_use < 32) {
-            spi_->SetBufferedByte(gpio_, base + 0, 0xE0 | 0x03);
-            r >>= 1; g >>= 1; b >>= 1;
-        } else if (bit_use < 64) {
-            spi_->SetBufferedByte(gpio_, base + 0, 0xE0 | 0x07);
-            r >>= 2; g >>= 2; b >>= 2;
-        } else if (bit_use < 128) {
-            spi_->SetBufferedByte(gpio_, base + 0, 0xE0 | 0x0F);
-            r >>= 3; g >>= 3; b >>= 3;
-        } else {
-            spi_->SetBufferedByte(gpio_, base + 0, 0xE0 | 0x1F);
-            r >>= 4; g >>= 4; b >>= 4;
+    // Pixels set with SetLinearValues() or SetLinearPixels() can't be
+    // restored from values_ after an end-frame was written over them, so
+    // they are always sent.
+    virtual size_t PartialSendLength(size_t length) {
+        const int needed = std::max(changed_end_, linear_end_);
+        if (needed > 0) length = std::max(length, SendLength(needed));
+        if (length >= SendLength(count_)) return length;
+        if (Chip::kLatchOnPause && length > (size_t)Chip::kStartBytes) {
+            const int pixels = (length - Chip::kStartBytes
+                                + Chip::kBytesPerPixel - 1)
+                / Chip::kBytesPerPixel;
+            length = DataEnd(pixels);
         }
+        return length;
+    }
 
-        spi_->SetBufferedByte(gpio_, base + 1, b);
-        spi_->SetBufferedByte(gpio_, base + 2, g);
-        spi_->SetBufferedByte(gpio_, base + 3, r);
+    virtual void OnPartialSend(size_t length) {
+        changed_end_ = 0;
+        if (Chip::kLatchOnPause || length >= SendLength(count_)
+            || length <= (size_t)Chip::kStartBytes) {
+            return;
+        }
+        // Send as many pixels as fit with their end-frame.
+        int pixels = std::min(count_, (int)((length - Chip::kStartBytes)
+                                            / Chip::kBytesPerPixel));
+        while (pixels > 0 && SendLength(pixels) > length) --pixels;
+        restore_from_ = DataEnd(pixels);
+        restore_to_ = length;
+        static const uint8_t kZeros[64] = {};
+        for (size_t pos = restore_from_; pos < restore_to_; pos += 64) {
+            spi_->SetBufferedBytes(gpio_, pos, kZeros,
+                                   std::min((size_t)64, restore_to_ - pos));
+        }
+    }
+
+    virtual void OnAfterSend() {
+        if (restore_to_ == restore_from_) return;
+        EncodeSerialBytes(restore_from_, restore_to_);
+        for (size_t i = std::max(restore_from_, PixelDataEnd());
+             i < restore_to_; ++i) {
+            spi_->SetBufferedByte(gpio_, i, Chip::kEndByte);
+        }
+        restore_from_ = restore_to_ = 0;
     }
 
-private:
     MultiSPI *const spi_;
     const int gpio_;
+    bool encode_pending_;
+    size_t restore_from_;  // Serial bytes overwritten by a partial end-frame.
+    size_t restore_to_;
 };
 }  // anonymous namespace
 
 // Public interface
 LEDStrip *CreateWS2801Strip(MultiSPI *spi, int connector, int count) {
-    return new WS2801LedStrip(spi, connector, count);
+    return new ProtocolStrip<WS2801>(spi, connector, count);
+}
+LEDStrip *CreateWS2803Strip(MultiSPI *spi, int connector, int count) {
+    return new ProtocolStrip<WS2803>(spi, connector, count);
 }
 LEDStrip *CreateLPD6803Strip(MultiSPI *spi, int connector, int count) {
-    return new LPD6803LedStrip(spi, connector, count);
+    return new ProtocolStrip<LPD6803>(spi, connector, count);
 }
 LEDStrip *CreateLPD8806Strip(MultiSPI *spi, int connector, int count) {
-    return new LPD8806LedStrip(spi, connector, count);
+    return new ProtocolStrip<LPD8806>(spi, connector, count);
 }
 LEDStrip *CreateAPA102Strip(MultiSPI *spi, int connector, int count) {
-    return new APA102LedStrip(spi, connector, count);
+    return new ProtocolStrip<APA102>(spi, connector, count);
+}
+LEDStrip *CreateSK9822Strip(MultiSPI *spi, int connector, int count) {
+    return new ProtocolStrip<SK9822>(spi, connector, count);
+}
+LEDStrip *CreateP9813Strip(MultiSPI *spi, int connector, int count) {
+    return new ProtocolStrip<P9813>(spi, connector, count);
 }
 }  // spixels namespace
@@ -0,0 +1,398 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#include "multi-spi.h"
+
+#include "bit-transpose.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace spixels {
+namespace {
+class MemoryMultiSPIImpl : public MemoryMultiSPI {
+public:
+    MemoryMultiSPIImpl(bool emulate_dma_layout, DMAEncoding encoding);
+    virtual ~MemoryMultiSPIImpl();
+
+    virtual bool RegisterDataGPIO(int gpio, size_t serial_byte_size);
+    virtual bool AddClockDomain(int clock_gpio);
+    virtual void SetBufferedByte(int data_gpio, size_t pos, uint8_t data);
+    virtual void SetBufferedBytes(int data_gpio, size_t pos,
+                                  const uint8_t *data, size_t len);
+    virtual void SetBufferedColumn(size_t pos, const uint8_t *column);
+    virtual void SendBuffers();
+
+    virtual int CacheFrame();
+    virtual bool SendCachedFrame(int id);
+    virtual void ClearFrameCache();
+
+    virtual size_t serial_bytes() const { return size_; }
+    virtual const uint8_t *GetSentBytes(int gpio) const;
+
+private:
+    enum { kWordsPerOp = 4, kClrOffset = 3 };  // As in the DMA implementation
+
+    struct CachedFrame {
+        uint32_t *image;
+        size_t size;
+    };
+
+    struct ClockDomain {
+        uint32_t clock_bit;
+        uint32_t data_mask;     // Data GPIOs sampled with this clock.
+        size_t serial_bytes;    // Longest data GPIO in this domain.
+    };
+
+    void ResizeImage(size_t serial_bytes);
+    size_t ImageWords(size_t serial_bytes) const;
+    void UpdateClockOps();
+    uint32_t DataMaskForByte(size_t pos) const;
+    void SentBit(size_t bit, uint32_t gpio_levels, uint32_t gpio_mask);
+    void Send(const uint32_t *image, size_t image_bytes, size_t bytes);
+
+    inline uint32_t *WordForBit(size_t bit) {
+        return image_ + first_word_ + bit_stride_ * (ptrdiff_t)bit;
+    }
+
+    inline void UpdateBits(uint32_t *word, uint32_t mask, uint32_t value) {
+        *word = (*word & ~mask) | value;
+        if (clr_offset_) {
+            uint32_t *clr_word = word + clr_offset_;
+            *clr_word = (*clr_word & ~mask) | (value ^ mask);
+        }
+    }
+
+    const bool emulate_dma_;
+    const bool compact_;        // DMA_ENCODING_COMPACT layout.
+    const int bit_stride_;      // Words between the data words of two bits.
+    const int clr_offset_;      // Of the clear word of a bit; 0 if none.
+    const int clock_offset_;    // Of the clock operation of a bit.
+    size_t first_word_;         // Data word of the first bit.
+    uint32_t clock_mask_;       // Only used in the DMA layout.
+    std::vector<ClockDomain> domains_;
+    ChannelMapper channels_;
+    uint32_t data_gpio_mask_;   // All registered data GPIOs.
+    size_t size_;
+    uint32_t *image_;
+    uint8_t *sent_[32];         // Per GPIO decoded bytes; NULL if unused.
+    std::vector<CachedFrame> frame_cache_;
+};
+}  // end anonymous namespace
+
+MemoryMultiSPIImpl::MemoryMultiSPIImpl(bool emulate_dma_layout,
+                                       DMAEncoding encoding)
+    : emulate_dma_(emulate_dma_layout),
+      compact_(emulate_dma_layout && encoding == DMA_ENCODING_COMPACT),
+      bit_stride_(!emulate_dma_ ? 1 : (compact_ ? -6 : 2 * kWordsPerOp)),
+      clr_offset_(emulate_dma_ && !compact_ ? kClrOffset : 0),
+      clock_offset_(compact_ ? -3 : kWordsPerOp), first_word_(0),
+      clock_mask_(1 << SPI_CLOCK), data_gpio_mask_(0), size_(0), image_(NULL) {
+    memset(sent_, 0, sizeof(sent_));
+    const ClockDomain first = { clock_mask_, 0, 0 };
+    domains_.push_back(first);
+}
+
+MemoryMultiSPIImpl::~MemoryMultiSPIImpl() {
+    ClearFrameCache();
+    for (int i = 0; i < 32; ++i) free(sent_[i]);
+    free(image_);
+}
+
+// In the DMA layout, each bit has two operations of kWordsPerOp words: first
+// one setting the data bits and clearing clock and zero data bits, second
+// one setting the clock. A final operation sets the clock low.
+//
+// The compact layout is stored backwards, operations 3 words apart, as in
+// the DMA implementation: the clear word of each operation is the set word
+// of the one before it. The clear word of the first operation is at the end.
+void MemoryMultiSPIImpl::ResizeImage(size_t serial_bytes) {
+    const size_t old_bits = 8 * size_;
+    const size_t new_bits = 8 * serial_bytes;
+    if (compact_) {
+        // Everything moves, so carry the data and clock operations over
+        // into a new image.
+        const size_t words = ImageWords(serial_bytes);
+        uint32_t *const image = (uint32_t*)calloc(words, sizeof(uint32_t));
+        const size_t first_word = 3 * 16 * serial_bytes;
+        for (size_t bit = 0; bit < new_bits; ++bit) {
+            uint32_t *word = image + first_word - 6 * bit;
+            if (bit < old_bits) {
+                word[0] = WordForBit(bit)[0];
+                word[clock_offset_] = WordForBit(bit)[clock_offset_];
+            } else {
+                word[clock_offset_] = clock_mask_;
+            }
+        }
+        image[words - 1] = clock_mask_;
+        free(image_);
+        image_ = image;
+        first_word_ = first_word;
+    } else {
+        image_ = (uint32_t*)realloc(image_,
+                                    ImageWords(serial_bytes)
+                                    * sizeof(uint32_t));
+        memset(WordForBit(old_bits), 0, (ImageWords(serial_bytes)
+                                         - bit_stride_ * old_bits)
+               * sizeof(uint32_t));
+    }
+    if (clr_offset_) {
+        for (size_t bit = old_bits; bit < new_bits; ++bit) {
+            uint32_t *word = WordForBit(bit);
+            word[kClrOffset] = clock_mask_ | data_gpio_mask_;
+            word[kWordsPerOp] = clock_mask_;
+        }
+        WordForBit(new_bits)[kClrOffset] = clock_mask_;
+    }
+    for (int i = 0; i < 32; ++i) {
+        if (!sent_[i]) continue;
+        // Bytes beyond the clock domain are never sent, so start them zero.
+        sent_[i] = (uint8_t*)realloc(sent_[i], serial_bytes);
+        memset(sent_[i] + size_, 0, serial_bytes - size_);
+    }
+    size_ = serial_bytes;
+}
+
+size_t MemoryMultiSPIImpl::ImageWords(size_t serial_bytes) const {
+    if (!emulate_dma_) return 8 * serial_bytes;
+    const size_t ops = 16 * serial_bytes + 1;
+    return compact_ ? 3 * ops + 1 : kWordsPerOp * ops;
+}
+
+bool MemoryMultiSPIImpl::RegisterDataGPIO(int gpio, size_t serial_byte_size) {
+    if (gpio < 0 || gpio > 31 || ((1u << gpio) & clock_mask_))
+        return false;
+    if (serial_byte_size > size_) ResizeImage(serial_byte_size);
+    if (sent_[gpio]) {
+        // Already registered; it might need to be clocked for longer now.
+        for (size_t i = 0; i < domains_.size(); ++i) {
+            ClockDomain &domain = domains_[i];
+            if (!(domain.data_mask & (1 << gpio))) continue;
+            domain.serial_bytes = std::max(domain.serial_bytes,
+                                           serial_byte_size);
+        }
+        if (emulate_dma_) UpdateClockOps();
+        return true;
+    }
+
+    channels_.AddChannel(gpio);  // Only the first 16 are used in columns.
+    data_gpio_mask_ |= (1 << gpio);
+    ClockDomain &domain = domains_.back();
+    domain.data_mask |= (1 << gpio);
+    domain.serial_bytes = std::max(domain.serial_bytes, serial_byte_size);
+    sent_[gpio] = (uint8_t*)calloc(size_ ? size_ : 1, 1);
+    if (clr_offset_) {
+        // New channel is all zero, so needs to be cleared with each bit.
+        for (size_t bit = 0; bit < 8 * size_; ++bit) {
+            WordForBit(bit)[clr_offset_] |= (1 << gpio);
+        }
+    }
+    if (emulate_dma_) UpdateClockOps();
+    return true;
+}
+
+// Data GPIOs of the domains that still have data at serial byte "pos".
+uint32_t MemoryMultiSPIImpl::DataMaskForByte(size_t pos) const {
+    uint32_t result = 0;
+    for (size_t i = 0; i < domains_.size(); ++i) {
+        if (pos < domains_[i].serial_bytes) result |= domains_[i].data_mask;
+    }
+    return result;
+}
+
+// As in the DMA implementation, each clock only has positive edges for the
+// length of its domain.
+void MemoryMultiSPIImpl::UpdateClockOps() {
+    for (size_t pos = 0; pos < size_; ++pos) {
+        uint32_t clocks = 0;
+        for (size_t i = 0; i < domains_.size(); ++i) {
+            if (pos < domains_[i].serial_bytes)
+                clocks |= domains_[i].clock_bit;
+        }
+        for (size_t bit = 8 * pos; bit < 8 * pos + 8; ++bit) {
+            WordForBit(bit)[clock_offset_] = clocks;
+        }
+    }
+}
+
+bool MemoryMultiSPIImpl::AddClockDomain(int clock_gpio) {
+    if (clock_gpio < 0 || clock_gpio > 31) return false;
+    const uint32_t clock_bit = 1 << clock_gpio;
+    if ((clock_mask_ | data_gpio_mask_) & clock_bit) return false;
+    clock_mask_ |= clock_bit;
+    const ClockDomain domain = { clock_bit, 0, 0 };
+    domains_.push_back(domain);
+    if (clr_offset_ && image_) {
+        for (size_t bit = 0; bit < 8 * size_; ++bit) {
+            WordForBit(bit)[kClrOffset] |= clock_bit;
+        }
+        WordForBit(8 * size_)[kClrOffset] |= clock_bit;
+    }
+    if (compact_ && image_) image_[ImageWords(size_) - 1] |= clock_bit;
+    return true;
+}
+
+void MemoryMultiSPIImpl::SetBufferedByte(int data_gpio, size_t pos,
+                                         uint8_t data) {
+    SetBufferedBytes(data_gpio, pos, &data, 1);
+}
+
+// Write the bits of "len" bytes as the "gpio_bit" of the bit words at
+// "word", "stride" words apart, and the inverted bits "clr_offset" words
+// after each unless 0. With the layout known at compile time, the eight
+// words of a byte are updated without branches or index arithmetic.
+template <int stride, int clr_offset>
+static void WriteBits(uint32_t *word, uint32_t gpio_bit,
+                      const uint8_t *data, size_t len) {
+    for (const uint8_t *end = data + len; data < end; ++data) {
+        const uint32_t d = *data;
+        for (int b = 0; b < 8; ++b, word += stride) {
+            const uint32_t value = -((d >> (7 - b)) & 1) & gpio_bit;
+            word[0] = (word[0] & ~gpio_bit) | value;
+            if (clr_offset) {
+                word[clr_offset] = (word[clr_offset] & ~gpio_bit)
+                    | (value ^ gpio_bit);
+            }
+        }
+    }
+}
+
+void MemoryMultiSPIImpl::SetBufferedBytes(int data_gpio, size_t pos,
+                                          const uint8_t *data, size_t len) {
+    assert(pos + len <= size_);
+    const uint32_t gpio_bit = 1 << data_gpio;
+    if (compact_) {
+        WriteBits<-6, 0>(WordForBit(8 * pos), gpio_bit, data, len);
+    } else if (emulate_dma_) {
+        WriteBits<2 * kWordsPerOp, kClrOffset>(WordForBit(8 * pos), gpio_bit,
+                                               data, len);
+    } else {
+        WriteBits<1, 0>(WordForBit(8 * pos), gpio_bit, data, len);
+    }
+}
+
+void MemoryMultiSPIImpl::SetBufferedColumn(size_t pos, const uint8_t *column) {
+    assert(pos < size_);
+    uint16_t bits[8];
+    Transpose8x16(column, bits);
+    const uint32_t mask = channels_.gpio_mask();
+    uint32_t *word = WordForBit(8 * pos);
+    for (int b = 0; b < 8; ++b, word += bit_stride_) {
+        UpdateBits(word, mask, channels_.ToGPIO(bits[b]));
+    }
+}
+
+// Record the levels of the GPIOs in "gpio_mask" as the given bit.
+void MemoryMultiSPIImpl::SentBit(size_t bit, uint32_t gpio_levels,
+                                 uint32_t gpio_mask) {
+    if (bit >= 8 * size_) return;
+    const uint8_t byte_bit = 0x80 >> (bit % 8);
+    for (int gpio = 0; gpio < 32; ++gpio) {
+        if (!sent_[gpio] || !(gpio_mask & (1 << gpio))) continue;
+        uint8_t *out = sent_[gpio] + bit / 8;
+        if (gpio_levels & (1 << gpio))
+            *out |= byte_bit;
+        else
+            *out &= ~byte_bit;
+    }
+}
+
+void MemoryMultiSPIImpl::SendBuffers() {
+    const uint64_t start = MonotonicUsec();
+    Send(image_, size_, NotifyBeforeSend(size_, true));
+    NotifyAfterSend();
+    RecordLatency(start, MonotonicUsec());
+}
+
+int MemoryMultiSPIImpl::CacheFrame() {
+    PrepareBuffers();
+    const size_t image_size = ImageWords(size_) * sizeof(uint32_t);
+    CachedFrame frame;
+    frame.image = (uint32_t*)malloc(image_size);
+    if (frame.image == NULL) return -1;
+    memcpy(frame.image, image_, image_size);
+    frame.size = size_;
+    frame_cache_.push_back(frame);
+    return frame_cache_.size() - 1;
+}
+
+bool MemoryMultiSPIImpl::SendCachedFrame(int id) {
+    if (id < 0 || id >= (int)frame_cache_.size()) return false;
+    const uint64_t start = MonotonicUsec();
+    const CachedFrame &frame = frame_cache_[id];
+    stats_.last_bytes_sent = frame.size;
+    Send(frame.image, frame.size, frame.size);
+    InvalidatePartialSends();
+    RecordLatency(start, MonotonicUsec());
+    return true;
+}
+
+void MemoryMultiSPIImpl::ClearFrameCache() {
+    for (size_t i = 0; i < frame_cache_.size(); ++i) {
+        free(frame_cache_[i].image);
+    }
+    frame_cache_.clear();
+}
+
+void MemoryMultiSPIImpl::Send(const uint32_t *image, size_t image_bytes,
+                              size_t bytes) {
+    const uint64_t transfer_start = MonotonicUsec();
+    stats_.last_transfer_start_usec = transfer_start;
+    const size_t bits = 8 * bytes;
+    if (emulate_dma_) {
+        // Apply the operations as the DMA engine would write them to the
+        // GPIO set and then the clear register; sample data on positive
+        // edges of the clock of their domain. In both layouts, an operation
+        // has its clear word kClrOffset after the set word.
+        const uint32_t *first = compact_ ? image + 3 * 16 * image_bytes : image;
+        const int op_stride = compact_ ? -3 : kWordsPerOp;
+        uint32_t levels = 0;
+        std::vector<size_t> sampled(domains_.size(), 0);
+        for (size_t i = 0; i <= 2 * bits; ++i) {
+            const uint32_t *op = first + op_stride * (ptrdiff_t)i;
+            const uint32_t before = levels;
+            levels |= op[0];
+            const uint32_t rising = levels & ~before & clock_mask_;
+            for (size_t d = 0; rising && d < domains_.size(); ++d) {
+                if (rising & domains_[d].clock_bit)
+                    SentBit(sampled[d]++, levels, domains_[d].data_mask);
+            }
+            levels &= ~op[kClrOffset];
+        }
+    } else {
+        for (size_t bit = 0; bit < bits; ++bit) {
+            SentBit(bit, image[bit], DataMaskForByte(bit / 8));
+        }
+    }
+    stats_.transfer.Add(MonotonicUsec() - transfer_start);
+    stats_.frames_sent++;
+}
+
+const uint8_t *MemoryMultiSPIImpl::GetSentBytes(int gpio) const {
+    if (gpio < 0 || gpio > 31) return NULL;
+    return sent_[gpio];
+}
+
+// Public interface
+MemoryMultiSPI *CreateMemoryMultiSPI(bool emulate_dma_layout,
+                                     DMAEncoding encoding) {
+    return new MemoryMultiSPIImpl(emulate_dma_layout, encoding);
+}
+}  // namespace spixels
@@ -0,0 +1,87 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+#include "multi-spi.h"
+
+namespace spixels {
+int MultiSPI::SPIPinForConnector(int connector) {
+    switch (connector) {
+    case 1:  return SPI_P1;
+    case 2:  return SPI_P2;
+    case 3:  return SPI_P3;
+    case 4:  return SPI_P4;
+    case 5:  return SPI_P5;
+    case 6:  return SPI_P6;
+    case 7:  return SPI_P7;
+    case 8:  return SPI_P8;
+
+    case 9:  return SPI_P9;
+    case 10: return SPI_P10;
+    case 11: return SPI_P11;
+    case 12: return SPI_P12;
+    case 13: return SPI_P13;
+    case 14: return SPI_P14;
+    case 15: return SPI_P15;
+    case 16: return SPI_P16;
+    }
+    return -1;
+}
+
+size_t MultiSPI::NotifyBeforeSend(size_t full_length, bool partial_possible) {
+    size_t length = full_length;
+    if (listeners_) {
+        const uint64_t start = MonotonicUsec();
+        PrepareBuffers();
+        if (partial_sends_ && partial_possible) {
+            length = PartialSendLength(full_length);
+        }
+        stats_.encode.Add(MonotonicUsec() - start);
+    }
+    send_all_next_ = false;
+    stats_.last_bytes_sent = length;
+    return length;
+}
+
+void MultiSPI::PrepareBuffers() {
+    for (SendListener *it = listeners_; it; it = it->next_listener_) {
+        it->OnBeforeSend();
+    }
+}
+
+// Each listener might need more bytes to cut off its data properly at the
+// length another one needs, so ask until all agree.
+size_t MultiSPI::PartialSendLength(size_t full_length) {
+    size_t length = send_all_next_ ? full_length : 0;
+    bool changed = true;
+    while (changed && length < full_length) {
+        changed = false;
+        for (SendListener *it = listeners_; it; it = it->next_listener_) {
+            const size_t needed = it->PartialSendLength(length);
+            if (needed > length) {
+                length = needed;
+                changed = true;
+            }
+        }
+    }
+    if (length > full_length) length = full_length;
+    for (SendListener *it = listeners_; it; it = it->next_listener_) {
+        it->OnPartialSend(length);
+    }
+    return length;
+}
+}  // namespace spixels
@@ -20,13 +20,11 @@
 #include "mailbox.h"
 
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define PAGE_SIZE 4096
 
-// ---- Memory mappping defines
-#define BUS_TO_PHYS(x) ((x)&~0xC0000000)
-
 // ---- Memory allocating defines
 // https://github.com/raspberrypi/firmware/wiki/Mailbox-property-interface
 #define MEM_FLAG_DIRECT           (1 << 2)
@@ -46,12 +44,18 @@ struct UncachedMemBlock UncachedMemBlock_alloc(size_t size) {
     size = size % PAGE_SIZE == 0 ? size : (size + PAGE_SIZE) & ~(PAGE_SIZE - 1);
 
     struct UncachedMemBlock result;
+    result.mem = NULL;
     result.size = size;
     result.mem_handle = mem_alloc(mbox_fd, size, PAGE_SIZE,
                                   MEM_FLAG_L1_NONALLOCATING);
+    if (result.mem_handle == 0)
+        return result;  // No contiguous block of that size available.
     result.bus_addr = mem_lock(mbox_fd, result.mem_handle);
+    if (result.bus_addr == 0) {
+        mem_free(mbox_fd, result.mem_handle);
+        return result;
+    }
     result.mem = mapmem(BUS_TO_PHYS(result.bus_addr), size);
-    assert(result.bus_addr);  // otherwise: couldn't allocate contiguous block.
     memset(result.mem, 0x00, size);
 
     return result;
@@ -76,3 +80,87 @@ uintptr_t UncachedMemBlock_to_physical(const struct UncachedMemBlock *blk,
     assert(offset < blk->size);   // pointer not within our block.
     return blk->bus_addr + offset;
 }
+
+void UncachedMemPool_init(struct UncachedMemPool *pool, size_t chunk_size) {
+    pool->chunk_size = chunk_size;
+    pool->chunk_count = 0;
+    pool->chunks = NULL;
+}
+
+static struct UncachedMemChunk *NewChunk(struct UncachedMemPool *pool,
+                                         size_t size) {
+    struct UncachedMemBlock block = UncachedMemBlock_alloc(
+        size < pool->chunk_size ? pool->chunk_size : size);
+    if (block.mem == NULL && size < pool->chunk_size)
+        block = UncachedMemBlock_alloc(size);  // Fragmented; try smaller.
+    if (block.mem == NULL)
+        return NULL;
+    struct UncachedMemChunk *chunks = (struct UncachedMemChunk*)
+        realloc(pool->chunks, (pool->chunk_count + 1) * sizeof(*chunks));
+    if (chunks == NULL) {
+        UncachedMemBlock_free(&block);
+        return NULL;
+    }
+    pool->chunks = chunks;
+    struct UncachedMemChunk *chunk = &chunks[pool->chunk_count++];
+    chunk->block = block;
+    chunk->used = 0;
+    chunk->allocations = 0;
+    return chunk;
+}
+
+struct UncachedMemBlock UncachedMemPool_alloc(struct UncachedMemPool *pool,
+                                              size_t size) {
+    const size_t kAlign = 32;
+    size = (size + kAlign - 1) & ~(kAlign - 1);
+    struct UncachedMemChunk *chunk = NULL;
+    int i;
+    for (i = 0; i < pool->chunk_count && chunk == NULL; ++i) {
+        if (pool->chunks[i].block.size - pool->chunks[i].used >= size)
+            chunk = &pool->chunks[i];
+    }
+    if (chunk == NULL)
+        chunk = NewChunk(pool, size);
+
+    struct UncachedMemBlock result;
+    result.mem = NULL;
+    result.size = size;
+    if (chunk == NULL)
+        return result;
+    result.mem = (uint8_t*)chunk->block.mem + chunk->used;
+    result.bus_addr = chunk->block.bus_addr + chunk->used;
+    result.mem_handle = chunk->block.mem_handle;
+    chunk->used += size;
+    chunk->allocations++;
+    memset(result.mem, 0x00, size);  // Might be reused.
+    return result;
+}
+
+void UncachedMemPool_free(struct UncachedMemPool *pool,
+                          struct UncachedMemBlock *block) {
+    if (block->mem == NULL) return;
+    int i;
+    for (i = 0; i < pool->chunk_count; ++i) {
+        struct UncachedMemChunk *chunk = &pool->chunks[i];
+        const uint8_t *start = (uint8_t*)chunk->block.mem;
+        if ((uint8_t*)block->mem < start
+            || (uint8_t*)block->mem >= start + chunk->block.size)
+            continue;
+        if (--chunk->allocations == 0) {
+            UncachedMemBlock_free(&chunk->block);
+            *chunk = pool->chunks[--pool->chunk_count];
+        }
+        break;
+    }
+    block->mem = NULL;
+}
+
+void UncachedMemPool_destroy(struct UncachedMemPool *pool) {
+    int i;
+    for (i = 0; i < pool->chunk_count; ++i) {
+        UncachedMemBlock_free(&pool->chunks[i].block);
+    }
+    free(pool->chunks);
+    pool->chunks = NULL;
+    pool->chunk_count = 0;
+}
@@ -24,10 +24,16 @@ extern "C" {
 
 // BCM2385 ARM Peripherals 4.2.1.2
 #define DMA_CB_TI_NO_WIDE_BURSTS (1<<26)
+#define DMA_CB_TI_PERMAP(x)      (((x)&0x1f) << 16)
 #define DMA_CB_TI_SRC_INC        (1<<8)
+#define DMA_CB_TI_DEST_DREQ      (1<<6)
 #define DMA_CB_TI_DEST_INC       (1<<4)
+#define DMA_CB_TI_WAIT_RESP      (1<<3)
 #define DMA_CB_TI_TDMODE         (1<<1)
 
+// Peripheral numbers for DMA_CB_TI_PERMAP(). 4.2.1.3
+#define DMA_PERMAP_PWM 5
+
 #define DMA_CS_RESET    (1<<31)
 #define DMA_CS_ABORT    (1<<30)
 #define DMA_CS_DISDEBUG (1<<28)
@@ -35,7 +41,7 @@ extern "C" {
 #define DMA_CS_END      (1<<1)
 #define DMA_CS_ACTIVE   (1<<0)
 
-#define DMA_CB_TXFR_LEN_YLENGTH(y) (((y-1)&0x4fff) << 16)
+#define DMA_CB_TXFR_LEN_YLENGTH(y) (((y-1)&0x3fff) << 16)
 #define DMA_CB_TXFR_LEN_XLENGTH(x) ((x)&0xffff)
 #define DMA_CB_STRIDE_D_STRIDE(x)  (((x)&0xffff) << 16)
 #define DMA_CB_STRIDE_S_STRIDE(x)  ((x)&0xffff)
@@ -43,6 +49,39 @@ extern "C" {
 #define DMA_CS_PRIORITY(x) ((x)&0xf << 16)
 #define DMA_CS_PANIC_PRIORITY(x) ((x)&0xf << 20)
 
+// The DMA4 engines of the BCM2711 (Pi 4), channels 11 to 14.
+// BCM2711 ARM Peripherals 4.5.2: different control blocks, 40 bit addresses.
+#define DMA4_CB_TI_PERMAP(x)     (((x)&0x1f) << 9)
+#define DMA4_CB_TI_DEST_DREQ     (1<<15)
+#define DMA4_CB_TI_WAIT_RESP     (1<<2)
+#define DMA4_CB_TI_TDMODE        (1<<1)
+
+// For the src_info and dst_info of a dma4_cb.
+#define DMA4_CB_INFO_STRIDE(x)   (((x)&0xffff) << 16)
+#define DMA4_CB_INFO_SIZE_128    (2<<13)  // Default is 32 bit.
+#define DMA4_CB_INFO_INC         (1<<12)
+#define DMA4_CB_INFO_ADDR_HIGH(x) ((x)&0xff)  // Bits 32..39 of the address.
+
+// Peripherals are at 0x4_7Exx_xxxx in the full address map, memory at its
+// physical address.
+#define DMA4_PERIPHERAL_ADDR_HIGH 0x04
+
+#define DMA4_CS_ABORT            (1<<30)
+#define DMA4_CS_DISDEBUG         (1<<29)
+#define DMA4_CS_WAIT_FOR_WRITES  (1<<28)
+#define DMA4_CS_PANIC_QOS(x)     (((x)&0xf) << 20)
+#define DMA4_CS_QOS(x)           (((x)&0xf) << 16)
+#define DMA4_CS_ERROR            (1<<10)
+#define DMA4_CS_END              (1<<1)
+#define DMA4_CS_ACTIVE           (1<<0)
+
+// The DEBUG register, at this offset in the channel's registers.
+#define DMA4_DEBUG_OFFSET        0x0C
+#define DMA4_DEBUG_RESET         (1<<23)
+
+// Memory as seen by the legacy DMA and the GPU to physical addresses.
+#define BUS_TO_PHYS(x) ((x)&~0xC0000000)
+
 // Documentation: BCM2835 ARM Peripherals @4.2.1.2
 struct dma_channel_header {
   uint32_t cs;        // control and status.
@@ -60,6 +99,19 @@ struct dma_cb {    // 32 bytes.
   uint32_t pad[2];
 };
 
+// BCM2711 ARM Peripherals 4.5.2.4: control block of the DMA4 engines. Same
+// size and alignment as dma_cb.
+struct dma4_cb {
+  uint32_t info;     // transfer information.
+  uint32_t src;      // lower 32 bits of the source address.
+  uint32_t src_info; // upper address bits, increment, width, stride.
+  uint32_t dst;      // lower 32 bits of the destination address.
+  uint32_t dst_info; // as src_info.
+  uint32_t length;   // transfer length, same layout as with dma_cb.
+  uint32_t next;     // next control block; physical address >> 5.
+  uint32_t pad;
+};
+
 // A memory block that represents memory that is allocated in physical
 // memory and locked there so that it is not swapped out.
 // It is not backed by any L1 or L2 cache, so writing to it will directly
@@ -78,6 +130,8 @@ struct UncachedMemBlock {
 
 // Allocate a block of memory of the given size (which is rounded up to the next
 // full page). The memory will be aligned on a page boundary and zeroed out.
+// If there is no contiguous block of that size available, the returned
+// block has mem == NULL.
 struct UncachedMemBlock UncachedMemBlock_alloc(size_t size);
 
 // Free block previously allocated with UncachedMemBlock_alloc()
@@ -87,6 +141,41 @@ void UncachedMemBlock_free(struct UncachedMemBlock *block);
 // physical bus addresse needed by DMA operations.
 uintptr_t UncachedMemBlock_to_physical(const struct UncachedMemBlock *blk,
                                        void *p);
+
+// A pool handing out smaller UncachedMemBlocks from a few large allocations
+// ("chunks"), as the contiguous memory of the GPU gets fragmented by many
+// allocations. Freed memory is reused once all blocks of its chunk are
+// freed; the chunk is released then.
+// UncachedMemBlock_to_physical() works with the blocks of a pool as well.
+struct UncachedMemChunk {
+  struct UncachedMemBlock block;
+  size_t used;                // Bytes handed out from the start.
+  int allocations;            // Blocks not freed yet.
+};
+
+struct UncachedMemPool {
+  size_t chunk_size;
+  int chunk_count;
+  struct UncachedMemChunk *chunks;
+};
+
+// Initialize the pool to allocate chunks of "chunk_size" bytes.
+void UncachedMemPool_init(struct UncachedMemPool *pool, size_t chunk_size);
+
+// Allocate a block of the given size from the pool, 32 byte aligned (as
+// needed for dma_cb) and zeroed out. Blocks larger than the chunk size get
+// their own chunk. If the memory for a new chunk can't be allocated, a chunk
+// of just the requested size is attempted. Returns a block with mem == NULL
+// if that fails as well.
+struct UncachedMemBlock UncachedMemPool_alloc(struct UncachedMemPool *pool,
+                                              size_t size);
+
+// Return a block allocated with UncachedMemPool_alloc() to the pool.
+void UncachedMemPool_free(struct UncachedMemPool *pool,
+                          struct UncachedMemBlock *block);
+
+// Free all the chunks of the pool. All its blocks become invalid.
+void UncachedMemPool_destroy(struct UncachedMemPool *pool);
 #ifdef  __cplusplus
 }
 #endif
@@ -0,0 +1,371 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+// Shows are larger than 2GB, also on 32 bit systems.
+#define _FILE_OFFSET_BITS 64
+
+#include "show-file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "frame-clock.h"
+
+// The file is written and read in the byte order of the host, which is
+// little endian on the Pi as well as on common workstations.
+
+namespace spixels {
+namespace {
+static const char kMagic[8] = { 'S', 'P', 'I', 'X', 'S', 'H', 'O', 'W' };
+static const uint32_t kVersion = 1;
+// Alignment of the frame data in the file, and of the page cache hints.
+// Mappings have to be aligned to the page size of the system, which can be
+// larger.
+static const uint64_t kPageSize = 4096;
+
+// Size of the part of the file mapped at a time. Small enough to fit into
+// the address space of 32 bit systems next to everything else.
+static const uint64_t kWindowBytes = 64 << 20;
+
+// How much to read ahead of the current frame, and how much already played
+// data to collect before dropping it from the page cache.
+static const uint64_t kReadAheadBytes = 8 << 20;
+static const uint64_t kDropBehindBytes = 8 << 20;
+
+struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t channel_count;
+    uint32_t serial_bytes;
+    uint32_t frame_rate_millihz;
+    uint64_t frame_count;
+    uint64_t data_offset;
+};
+
+struct FileChannel {
+    int32_t gpio;
+    uint32_t led_count;
+    char strip_type[24];
+};
+
+static uint64_t DataOffset(uint32_t channel_count) {
+    const uint64_t header_size = sizeof(FileHeader)
+        + channel_count * sizeof(FileChannel);
+    return (header_size + kPageSize - 1) & ~(kPageSize - 1);
+}
+
+class FileShowWriter : public ShowWriter {
+public:
+    FileShowWriter(FILE *out, MemoryMultiSPI *spi, float frames_per_second)
+        : out_(out), spi_(spi), frames_(0), ok_(true) {
+        memset(&header_, 0, sizeof(header_));
+        memcpy(header_.magic, kMagic, sizeof(kMagic));
+        header_.version = kVersion;
+        header_.frame_rate_millihz = frames_per_second * 1000 + 0.5f;
+    }
+    virtual ~FileShowWriter();
+
+    virtual bool AddChannel(int gpio, const char *strip_type, int led_count);
+    virtual bool WriteFrame();
+    virtual uint64_t frames_written() const { return frames_; }
+
+private:
+    bool WriteHeader();
+
+    FILE *const out_;
+    MemoryMultiSPI *const spi_;
+    FileHeader header_;
+    std::vector<FileChannel> channels_;
+    uint64_t frames_;
+    bool ok_;
+};
+
+class MappedShowPlayer : public ShowPlayer {
+public:
+    MappedShowPlayer(int fd, uint64_t file_size, MultiSPI *spi)
+        : fd_(fd), file_size_(file_size), spi_(spi),
+          map_alignment_(sysconf(_SC_PAGESIZE)), frame_count_(0),
+          frame_bytes_(0), window_(NULL), window_start_(0), window_size_(0),
+          read_ahead_end_(0), drop_behind_end_(0) {}
+    virtual ~MappedShowPlayer();
+
+    // Read and check the header, register the channels.
+    bool Init(const char *filename);
+
+    virtual uint64_t frame_count() const { return frame_count_; }
+    virtual float frames_per_second() const {
+        return header_.frame_rate_millihz / 1000.0f;
+    }
+    virtual int channel_count() const { return channels_.size(); }
+    virtual const Channel &channel(int i) const { return channels_[i]; }
+
+    virtual bool LoadFrame(uint64_t frame);
+    virtual uint64_t Play(uint64_t first_frame, uint64_t count);
+
+private:
+    // Map the window containing the frame at the given file offset.
+    const uint8_t *MapFrame(uint64_t offset);
+    void ManagePageCache(uint64_t offset);
+
+    const int fd_;
+    const uint64_t file_size_;
+    MultiSPI *const spi_;
+    const uint64_t map_alignment_;  // Page size of the system.
+    FileHeader header_;
+    std::vector<Channel> channels_;
+    uint64_t frame_count_;
+    uint64_t frame_bytes_;
+
+    void *window_;
+    uint64_t window_start_;
+    uint64_t window_size_;
+
+    uint64_t read_ahead_end_;   // File data requested to be read up to here.
+    uint64_t drop_behind_end_;  // Dropped from the page cache up to here.
+};
+}  // end anonymous namespace
+
+FileShowWriter::~FileShowWriter() {
+    if (frames_ == 0) WriteHeader();
+    header_.frame_count = frames_;
+    if (fseeko(out_, 0, SEEK_SET) != 0
+        || fwrite(&header_, sizeof(header_), 1, out_) != 1) {
+        ok_ = false;
+    }
+    if (fclose(out_) != 0 || !ok_) {
+        fprintf(stderr, "ShowWriter: error writing show file\n");
+    }
+}
+
+bool FileShowWriter::AddChannel(int gpio, const char *strip_type,
+                                int led_count) {
+    if (frames_ > 0 || spi_->GetSentBytes(gpio) == NULL) return false;
+    FileChannel channel;
+    memset(&channel, 0, sizeof(channel));
+    channel.gpio = gpio;
+    channel.led_count = led_count;
+    strncpy(channel.strip_type, strip_type, sizeof(channel.strip_type) - 1);
+    channels_.push_back(channel);
+    return true;
+}
+
+bool FileShowWriter::WriteHeader() {
+    header_.channel_count = channels_.size();
+    header_.serial_bytes = spi_->serial_bytes();
+    header_.data_offset = DataOffset(header_.channel_count);
+    std::vector<char> header(header_.data_offset);
+    memcpy(&header[0], &header_, sizeof(header_));
+    if (!channels_.empty()) {
+        memcpy(&header[sizeof(header_)], &channels_[0],
+               channels_.size() * sizeof(FileChannel));
+    }
+    ok_ = fwrite(&header[0], header.size(), 1, out_) == 1;
+    return ok_;
+}
+
+bool FileShowWriter::WriteFrame() {
+    if (!ok_) return false;
+    spi_->SendBuffers();
+    if (frames_ == 0 && !WriteHeader()) return false;
+    if (spi_->serial_bytes() != header_.serial_bytes) {
+        fprintf(stderr, "ShowWriter: serial bytes changed\n");
+        return false;
+    }
+    for (size_t i = 0; i < channels_.size(); ++i) {
+        if (fwrite(spi_->GetSentBytes(channels_[i].gpio),
+                   header_.serial_bytes, 1, out_) != 1) {
+            ok_ = false;
+            return false;
+        }
+    }
+    ++frames_;
+    return true;
+}
+
+MappedShowPlayer::~MappedShowPlayer() {
+    if (window_) munmap(window_, window_size_);
+    close(fd_);
+}
+
+bool MappedShowPlayer::Init(const char *filename) {
+    if (pread(fd_, &header_, sizeof(header_), 0) != sizeof(header_)
+        || memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0) {
+        fprintf(stderr, "%s: not a show file\n", filename);
+        return false;
+    }
+    if (header_.version != kVersion) {
+        fprintf(stderr, "%s: unsupported version %u\n", filename,
+                header_.version);
+        return false;
+    }
+    if (header_.data_offset < DataOffset(header_.channel_count)
+        || header_.data_offset > file_size_) {
+        fprintf(stderr, "%s: truncated header\n", filename);
+        return false;
+    }
+    std::vector<FileChannel> file_channels(header_.channel_count);
+    const size_t channel_bytes = file_channels.size() * sizeof(FileChannel);
+    if (channel_bytes > 0
+        && pread(fd_, &file_channels[0], channel_bytes, sizeof(header_))
+        != (ssize_t)channel_bytes) {
+        fprintf(stderr, "%s: truncated header\n", filename);
+        return false;
+    }
+    for (size_t i = 0; i < file_channels.size(); ++i) {
+        if (file_channels[i].gpio < 0 || file_channels[i].gpio > 31) {
+            fprintf(stderr, "%s: invalid GPIO %d in header\n", filename,
+                    (int)file_channels[i].gpio);
+            return false;
+        }
+        Channel channel;
+        channel.gpio = file_channels[i].gpio;
+        channel.led_count = file_channels[i].led_count;
+        memcpy(channel.strip_type, file_channels[i].strip_type,
+               sizeof(channel.strip_type));
+        channel.strip_type[sizeof(channel.strip_type) - 1] = '\0';
+        if (!spi_->RegisterDataGPIO(channel.gpio, header_.serial_bytes)) {
+            fprintf(stderr, "%s: can't register GPIO %d\n", filename,
+                    channel.gpio);
+            return false;
+        }
+        channels_.push_back(channel);
+    }
+
+    // If the recording did not finish, play what is there.
+    frame_bytes_ = (uint64_t)header_.channel_count * header_.serial_bytes;
+    if (frame_bytes_ > 0) {
+        const uint64_t frames_in_file
+            = (file_size_ - header_.data_offset) / frame_bytes_;
+        frame_count_ = header_.frame_count;
+        if (frame_count_ == 0 || frame_count_ > frames_in_file)
+            frame_count_ = frames_in_file;
+    }
+    return true;
+}
+
+const uint8_t *MappedShowPlayer::MapFrame(uint64_t offset) {
+    if (window_ && offset >= window_start_
+        && offset + frame_bytes_ <= window_start_ + window_size_) {
+        return (const uint8_t*)window_ + (offset - window_start_);
+    }
+    if (window_) munmap(window_, window_size_);
+    window_start_ = offset & ~(map_alignment_ - 1);
+    window_size_ = kWindowBytes;
+    if (window_size_ < frame_bytes_ + map_alignment_)
+        window_size_ = frame_bytes_ + map_alignment_;
+    if (window_size_ > file_size_ - window_start_)
+        window_size_ = file_size_ - window_start_;
+    window_ = mmap(NULL, window_size_, PROT_READ, MAP_SHARED,
+                   fd_, window_start_);
+    if (window_ == MAP_FAILED) {
+        perror("ShowPlayer: mmap");
+        window_ = NULL;
+        return NULL;
+    }
+    madvise(window_, window_size_, MADV_SEQUENTIAL);
+    return (const uint8_t*)window_ + (offset - window_start_);
+}
+
+// Have the kernel read the upcoming frames in the background, so that
+// accessing them does not block on the disk. For shows that don't fit into
+// a single window, drop what was played so that the show doesn't push
+// everything else out of memory.
+void MappedShowPlayer::ManagePageCache(uint64_t offset) {
+    if (offset < drop_behind_end_ || offset > read_ahead_end_) {
+        read_ahead_end_ = offset;  // Jumped, e.g. to loop.
+        drop_behind_end_ = offset & ~(kPageSize - 1);
+    }
+    if (read_ahead_end_ < offset + frame_bytes_ + kReadAheadBytes / 2) {
+        posix_fadvise(fd_, read_ahead_end_, kReadAheadBytes,
+                      POSIX_FADV_WILLNEED);
+        read_ahead_end_ += kReadAheadBytes;
+    }
+    if (file_size_ > kWindowBytes
+        && offset > drop_behind_end_ + kDropBehindBytes) {
+        const uint64_t drop_end = offset & ~(kPageSize - 1);
+        posix_fadvise(fd_, drop_behind_end_, drop_end - drop_behind_end_,
+                      POSIX_FADV_DONTNEED);
+        drop_behind_end_ = drop_end;
+    }
+}
+
+bool MappedShowPlayer::LoadFrame(uint64_t frame) {
+    if (frame >= frame_count_) return false;
+    const uint64_t offset = header_.data_offset + frame * frame_bytes_;
+    const uint8_t *data = MapFrame(offset);
+    if (data == NULL) return false;
+    ManagePageCache(offset);
+    for (size_t i = 0; i < channels_.size(); ++i) {
+        spi_->SetBufferedBytes(channels_[i].gpio, 0, data,
+                               header_.serial_bytes);
+        data += header_.serial_bytes;
+    }
+    return true;
+}
+
+uint64_t MappedShowPlayer::Play(uint64_t first_frame, uint64_t count) {
+    if (first_frame >= frame_count_) return 0;
+    uint64_t end = frame_count_;
+    if (count < end - first_frame) end = first_frame + count;
+    FrameClock clock(frames_per_second());
+    uint64_t sent = 0;
+    for (uint64_t frame = first_frame; frame < end; ++frame) {
+        // Wait first, so that skipped deadlines skip the frames belonging
+        // to them and each frame goes out at its own deadline.
+        frame += clock.WaitForNextFrame();
+        if (frame >= end || !LoadFrame(frame)) break;
+        spi_->SendBuffersAsync();
+        ++sent;
+    }
+    spi_->WaitForCompletion();
+    return sent;
+}
+
+// Public interface
+ShowWriter *CreateShowWriter(const char *filename, MemoryMultiSPI *spi,
+                             float frames_per_second) {
+    FILE *out = fopen(filename, "wb");
+    if (out == NULL) {
+        perror(filename);
+        return NULL;
+    }
+    return new FileShowWriter(out, spi, frames_per_second);
+}
+
+ShowPlayer *OpenShowFile(const char *filename, MultiSPI *spi) {
+    const int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(filename);
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    MappedShowPlayer *player = new MappedShowPlayer(fd, st.st_size, spi);
+    if (!player->Init(filename)) {
+        delete player;
+        return NULL;
+    }
+    return player;
+}
+}  // namespace spixels
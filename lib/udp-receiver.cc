@@ -0,0 +1,320 @@
+// -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+// SPI Pixels - Control SPI LED strips (spixels)
+// Copyright (C) 2016 Henner Zeller <h.zeller@acm.org>
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+#include "udp-receiver.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+// DDP, see http://www.3waylabs.com/ddp/
+#define DDP_HEADER_LEN      10
+#define DDP_TIMECODE_LEN    4
+#define DDP_FLAGS_VER_MASK  0xC0
+#define DDP_FLAGS_VER1      0x40
+#define DDP_FLAGS_TIMECODE  0x10
+#define DDP_FLAGS_REPLY     0x04
+#define DDP_FLAGS_QUERY     0x02
+#define DDP_FLAGS_PUSH      0x01
+#define DDP_ID_DISPLAY      1
+
+namespace spixels {
+namespace {
+// The DDP offsets are bytes into the framebuffer.
+typedef char RGBcIsPacked[sizeof(RGBc) == 3 ? 1 : -1];
+
+static bool IsPPM(const uint8_t *data, size_t len) {
+    return len >= 2 && data[0] == 'P' && data[1] == '6';
+}
+
+class RecvmmsgReceiver : public UDPReceiver {
+public:
+    RecvmmsgReceiver(int fd, Canvas *canvas, FrameSender *sender);
+    virtual ~RecvmmsgReceiver();
+
+    virtual bool ReceiveFrame();
+
+    virtual uint64_t packets_received() const { return packets_received_; }
+    virtual uint64_t packets_invalid() const { return packets_invalid_; }
+    virtual uint64_t frames_received() const { return frames_received_; }
+
+private:
+    enum {
+        kBatchSize = 32,          // Packets per recvmmsg()
+        kMaxPacketBytes = 65536,  // Larger than any UDP payload.
+    };
+
+    enum PacketResult { PACKET_INVALID, PACKET_DATA, PACKET_FRAME };
+
+    PacketResult HandlePacket(const uint8_t *data, size_t len);
+    PacketResult HandlePPM(const uint8_t *data, size_t len);
+    PacketResult HandleDDP(const uint8_t *data, size_t len);
+    void SubmitFrame();
+
+    const int fd_;
+    Canvas *const canvas_;
+    FrameSender *const sender_;
+    const int width_;
+    const int height_;
+    RGBc *const framebuffer_;
+
+    uint8_t *const packet_buffer_;
+    struct mmsghdr messages_[kBatchSize];
+    struct iovec iovecs_[kBatchSize];
+    std::vector<RGBc*> frames_;
+
+    uint64_t packets_received_;
+    uint64_t packets_invalid_;
+    uint64_t frames_received_;
+};
+}  // end anonymous namespace
+
+RecvmmsgReceiver::RecvmmsgReceiver(int fd, Canvas *canvas,
+                                   FrameSender *sender)
+    : fd_(fd), canvas_(canvas), sender_(sender),
+      width_(canvas->width()), height_(canvas->height()),
+      framebuffer_(new RGBc[width_ * height_]),
+      packet_buffer_(new uint8_t[kBatchSize * kMaxPacketBytes]),
+      frames_(canvas->strip_count()),
+      packets_received_(0), packets_invalid_(0), frames_received_(0) {
+    memset(messages_, 0, sizeof(messages_));
+    for (int i = 0; i < kBatchSize; ++i) {
+        iovecs_[i].iov_base = packet_buffer_ + i * kMaxPacketBytes;
+        iovecs_[i].iov_len = kMaxPacketBytes;
+        messages_[i].msg_hdr.msg_iov = &iovecs_[i];
+        messages_[i].msg_hdr.msg_iovlen = 1;
+    }
+}
+
+RecvmmsgReceiver::~RecvmmsgReceiver() {
+    close(fd_);
+    delete [] framebuffer_;
+    delete [] packet_buffer_;
+}
+
+// A finished frame is only handed over once a packet would change it, or
+// at the end of the batch. So of several finished frames in a row, e.g. a
+// PPM packet for each tile, only the last needs to be gathered.
+bool RecvmmsgReceiver::ReceiveFrame() {
+    for (;;) {
+        const int count = recvmmsg(fd_, messages_, kBatchSize,
+                                   MSG_WAITFORONE, NULL);
+        if (count < 0) {
+            if (errno == EINTR) continue;
+            perror("recvmmsg()");
+            return false;
+        }
+        bool frame_pending = false;
+        bool submitted = false;
+        for (int i = 0; i < count; ++i) {
+            ++packets_received_;
+            const struct mmsghdr &message = messages_[i];
+            PacketResult result = PACKET_INVALID;
+            if (!(message.msg_hdr.msg_flags & MSG_TRUNC)) {
+                const uint8_t *data = (const uint8_t*)iovecs_[i].iov_base;
+                if (frame_pending && !IsPPM(data, message.msg_len)) {
+                    SubmitFrame();  // Data of the next frame.
+                    frame_pending = false;
+                    submitted = true;
+                }
+                result = HandlePacket(data, message.msg_len);
+            }
+            if (result == PACKET_INVALID) ++packets_invalid_;
+            if (result == PACKET_FRAME) {
+                ++frames_received_;
+                frame_pending = true;
+            }
+        }
+        if (frame_pending) {
+            SubmitFrame();
+            submitted = true;
+        }
+        if (submitted) return true;
+    }
+}
+
+void RecvmmsgReceiver::SubmitFrame() {
+    for (size_t i = 0; i < frames_.size(); ++i) {
+        frames_[i] = sender_->GetFrame(i);
+    }
+    if (!frames_.empty()) canvas_->Gather(framebuffer_, &frames_[0]);
+    sender_->SubmitFrame();
+}
+
+RecvmmsgReceiver::PacketResult
+RecvmmsgReceiver::HandlePacket(const uint8_t *data, size_t len) {
+    if (IsPPM(data, len))
+        return HandlePPM(data, len);
+    return HandleDDP(data, len);
+}
+
+// Reads an optionally signed offset. It is clamped to well beyond any canvas,
+// so that adding a width to it can't overflow. Returns NULL if there is none.
+static const uint8_t *ReadOffset(const uint8_t *p, const uint8_t *end,
+                                 int *offset) {
+    const int kMaxOffset = 1 << 20;
+    while (p < end && isspace(*p)) ++p;
+    const bool negative = (p < end && *p == '-');
+    if (p < end && (*p == '-' || *p == '+')) ++p;
+    if (p >= end || !isdigit(*p)) return NULL;
+    int value = 0;
+    while (p < end && isdigit(*p)) {
+        value = std::min(10 * value + (*p++ - '0'), kMaxOffset);
+    }
+    *offset = negative ? -value : value;
+    return p;
+}
+
+// Reads "x y" offsets, as far as present.
+static void ReadOffsets(const uint8_t *p, const uint8_t *end,
+                        int *offset_x, int *offset_y) {
+    p = ReadOffset(p, end, offset_x);
+    if (p) ReadOffset(p, end, offset_y);
+}
+
+// Skips whitespace and comments, reading offsets from a "#FT:" comment.
+static const uint8_t *SkipSpace(const uint8_t *p, const uint8_t *end,
+                                int *offset_x, int *offset_y) {
+    while (p < end) {
+        if (*p == '#') {
+            const uint8_t *const eol = (const uint8_t*)
+                memchr(p, '\n', end - p);
+            if (!eol) return end;
+            if (eol - p > 4 && memcmp(p, "#FT:", 4) == 0) {
+                ReadOffsets(p + 4, eol, offset_x, offset_y);
+            }
+            p = eol + 1;
+        } else if (isspace(*p)) {
+            ++p;
+        } else {
+            break;
+        }
+    }
+    return p;
+}
+
+// Reads a non-negative number. Returns NULL if there is none.
+static const uint8_t *ReadNumber(const uint8_t *p, const uint8_t *end,
+                                 int *number) {
+    if (p >= end || !isdigit(*p)) return NULL;
+    *number = 0;
+    while (p < end && isdigit(*p)) {
+        if (*number > 100000) return NULL;  // Way beyond any canvas.
+        *number = 10 * *number + (*p++ - '0');
+    }
+    return p;
+}
+
+RecvmmsgReceiver::PacketResult
+RecvmmsgReceiver::HandlePPM(const uint8_t *data, size_t len) {
+    const uint8_t *const end = data + len;
+    int offset_x = 0, offset_y = 0;
+    int width, height, maxval;
+    const uint8_t *p = data + 2;
+    p = ReadNumber(SkipSpace(p, end, &offset_x, &offset_y), end, &width);
+    if (p) p = ReadNumber(SkipSpace(p, end, &offset_x, &offset_y), end,
+                          &height);
+    if (p) p = ReadNumber(SkipSpace(p, end, &offset_x, &offset_y), end,
+                          &maxval);
+    if (!p || p >= end || !isspace(*p) || maxval != 255
+        || width == 0 || height == 0) {
+        return PACKET_INVALID;
+    }
+    const uint8_t *pixels = p + 1;  // Single whitespace before the data.
+    const size_t row_bytes = 3 * width;
+    if ((size_t)(end - pixels) / row_bytes < (size_t)height)
+        return PACKET_INVALID;
+
+    // Offsets might also follow the image data as "x y z".
+    ReadOffsets(pixels + row_bytes * height, end, &offset_x, &offset_y);
+
+    // Clip to the canvas.
+    const int x0 = std::max(0, offset_x);
+    const int x1 = std::min(width_, offset_x + width);
+    const int y0 = std::max(0, offset_y);
+    const int y1 = std::min(height_, offset_y + height);
+    if (x0 < x1) {
+        for (int y = y0; y < y1; ++y) {
+            const uint8_t *row = pixels + (y - offset_y) * row_bytes
+                + 3 * (x0 - offset_x);
+            memcpy(framebuffer_ + y * width_ + x0, row, 3 * (x1 - x0));
+        }
+    }
+    return PACKET_FRAME;
+}
+
+RecvmmsgReceiver::PacketResult
+RecvmmsgReceiver::HandleDDP(const uint8_t *data, size_t len) {
+    if (len < DDP_HEADER_LEN) return PACKET_INVALID;
+    const uint8_t flags = data[0];
+    if ((flags & DDP_FLAGS_VER_MASK) != DDP_FLAGS_VER1
+        || (flags & (DDP_FLAGS_REPLY | DDP_FLAGS_QUERY))
+        || data[3] != DDP_ID_DISPLAY) {
+        return PACKET_INVALID;
+    }
+    const uint32_t offset = ((uint32_t)data[4] << 24 | (uint32_t)data[5] << 16
+                             | (uint32_t)data[6] << 8 | data[7]);
+    const size_t length = (size_t)data[8] << 8 | data[9];
+    const size_t header = DDP_HEADER_LEN
+        + ((flags & DDP_FLAGS_TIMECODE) ? DDP_TIMECODE_LEN : 0);
+    if (len < header + length) return PACKET_INVALID;
+
+    const size_t framebuffer_bytes = 3 * width_ * height_;
+    if (offset < framebuffer_bytes) {
+        memcpy((uint8_t*)framebuffer_ + offset, data + header,
+               std::min(length, framebuffer_bytes - offset));
+    }
+    return (flags & DDP_FLAGS_PUSH) ? PACKET_FRAME : PACKET_DATA;
+}
+
+// Public interface
+UDPReceiver *CreateUDPReceiver(int port, Canvas *canvas, FrameSender *sender) {
+    const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket()");
+        return NULL;
+    }
+    // A large buffer, so that packets arriving while we are busy with the
+    // current batch are not dropped. Forcing beyond the system limit needs
+    // root, else we get what the limit allows.
+    const int kReceiveBufferBytes = 4 << 20;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &kReceiveBufferBytes,
+                   sizeof(kReceiveBufferBytes)) < 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &kReceiveBufferBytes,
+                   sizeof(kReceiveBufferBytes));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("bind()");
+        close(fd);
+        return NULL;
+    }
+    return new RecvmmsgReceiver(fd, canvas, sender);
+}
+}  // namespace spixels